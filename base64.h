@@ -0,0 +1,165 @@
+#ifndef BASE64_RELAY_H
+#define BASE64_RELAY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <Simd.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define USERID64_SIMD
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define USERID64_TARGET
+#else
+#define USERID64_TARGET __attribute__((target("ssse3")))
+#endif
+#endif
+
+/*
+		UserId Base64
+	> Text messages carry their 8-byte UserId as 12 base64 characters, the
+	last one always being the '=' pad.  Both directions are fixed width, so
+	the kernels below transcode the whole prefix at once instead of walking
+	it character by character.  Decoding validates every character and
+	fails on anything outside the standard alphabet, or on a last
+	character with any of its two padding bits set, so that every UserId
+	has exactly one accepted encoding.
+
+	The SSSE3 kernels follow Wojciech Mula's pshufb base64 codec.  Twelve
+	characters fit one 128-bit register, AVX2 would only add empty lanes.
+	They are compiled for SSSE3 whatever the target of the build, and run
+	where uWS::Simd picked SSE4 or wider at startup (which implies SSSE3).
+*/
+#define USERID64_LENGTH 12
+
+static const char USERID64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Writes the 12-character encoding of the 8 bytes at userId to out
+inline void EncodeUserId64Scalar(const void* userId, char* out) {
+	const unsigned char* in = (const unsigned char*)userId;
+	uint64_t bits = 0;
+	for (int i = 0; i < 8; i++) {
+		bits = (bits << 8) | in[i];
+	}
+	// 11 sextets cover 66 bits, the last one is padded with two zero bits
+	out[0] = USERID64_ALPHABET[in[0] >> 2];
+	bits <<= 2;
+	for (int i = 10; i >= 1; i--) {
+		out[i] = USERID64_ALPHABET[bits & 0x3F];
+		bits >>= 6;
+	}
+	out[11] = '=';
+}
+
+// Decodes 12 characters into the 8 bytes at userId, false if in is not a valid encoding
+inline bool DecodeUserId64Scalar(const char* in, void* userId) {
+	static const int8_t T[256] = {
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
+		-1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,
+		-1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
+	const unsigned char* chars = (const unsigned char*)in;
+	int8_t first = T[chars[0]];
+	int invalid = (first < 0) | (chars[11] != '=');
+	uint64_t bits = 0;
+	for (int i = 1; i < 11; i++) {
+		int8_t sextet = T[chars[i]];
+		invalid |= sextet < 0;
+		bits = (bits << 6) | (uint64_t)(sextet & 0x3F);
+	}
+	invalid |= (int)(bits & 3);
+	if (invalid) {
+		return false;
+	}
+	bits = ((uint64_t)(first & 0x3F) << 58) | (bits >> 2);
+	unsigned char* out = (unsigned char*)userId;
+	for (int i = 7; i >= 0; i--) {
+		out[i] = (unsigned char)bits;
+		bits >>= 8;
+	}
+	return true;
+}
+
+#ifdef USERID64_SIMD
+USERID64_TARGET inline void EncodeUserId64Simd(const void* userId, char* out) {
+	// Three groups of 3 bytes (the 9th is zero), each spread over 4 lanes as b1 b0 b2 b1
+	__m128i in = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i*)userId), _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, -1, -1, -1, -1));
+	__m128i t0 = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+	__m128i t1 = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+	__m128i sextets = _mm_or_si128(t0, t1);
+
+	// Sextet to ASCII: one offset per alphabet range, picked by pshufb
+	__m128i range = _mm_subs_epu8(sextets, _mm_set1_epi8(51));
+	range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), sextets), _mm_set1_epi8(13)));
+	__m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+		'0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+	__m128i ascii = _mm_add_epi8(sextets, _mm_shuffle_epi8(offsets, range));
+
+	// Only 12 bytes may be written, the message payload follows them
+	_mm_storel_epi64((__m128i*)out, ascii);
+	uint32_t tail = (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(ascii, 8));
+	memcpy(out + 8, &tail, 4);
+	out[11] = '=';
+}
+
+USERID64_TARGET inline bool DecodeUserId64Simd(const char* in, void* userId) {
+	uint32_t tail;
+	memcpy(&tail, in + 8, 4);
+	__m128i chars = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)in), _mm_cvtsi32_si128((int)tail));
+
+	// A character is valid if the bit of its high nibble is set in the mask of its low nibble
+	__m128i high = _mm_and_si128(_mm_srli_epi32(chars, 4), _mm_set1_epi8(0x0F));
+	__m128i low  = _mm_and_si128(chars, _mm_set1_epi8(0x0F));
+	__m128i masks = _mm_setr_epi8((char)0xA8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8, (char)0xF8,
+		(char)0xF8, (char)0xF8, (char)0xF0, 0x54, 0x50, 0x50, 0x50, 0x54);
+	__m128i bits = _mm_setr_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i valid = _mm_and_si128(_mm_shuffle_epi8(masks, low), _mm_shuffle_epi8(bits, high));
+	int invalid = _mm_movemask_epi8(_mm_cmpeq_epi8(valid, _mm_setzero_si128())) & 0x07FF;
+	if (invalid || in[11] != '=') {
+		return false;
+	}
+
+	// ASCII to sextet: one offset per high nibble, '/' shares its nibble with '+'
+	__m128i offsets = _mm_setr_epi8(0, 0, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	__m128i shift = _mm_add_epi8(_mm_shuffle_epi8(offsets, high), _mm_and_si128(_mm_cmpeq_epi8(chars, _mm_set1_epi8('/')), _mm_set1_epi8(-3)));
+	__m128i sextets = _mm_add_epi8(chars, shift);
+
+	// The padding bits of the last sextet must be clear, and the '=' lane must not carry into it
+	if (_mm_extract_epi16(sextets, 5) & 0x03) {
+		return false;
+	}
+	sextets = _mm_and_si128(sextets, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 0, 0, 0, 0));
+
+	// Pack 4 sextets into 3 bytes per 32-bit lane, then gather the bytes in order
+	__m128i pairs = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+	__m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+	__m128i bytes = _mm_shuffle_epi8(words, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+	_mm_storel_epi64((__m128i*)userId, bytes);
+	return true;
+}
+#endif
+
+inline void EncodeUserId64(const void* userId, char* out) {
+#ifdef USERID64_SIMD
+	if (uWS::Simd::level() >= uWS::Simd::SSE4) {
+		EncodeUserId64Simd(userId, out);
+		return;
+	}
+#endif
+	EncodeUserId64Scalar(userId, out);
+}
+
+inline bool DecodeUserId64(const char* in, void* userId) {
+#ifdef USERID64_SIMD
+	if (uWS::Simd::level() >= uWS::Simd::SSE4) {
+		return DecodeUserId64Simd(in, userId);
+	}
+#endif
+	return DecodeUserId64Scalar(in, userId);
+}
+
+#endif // BASE64_RELAY_H
@@ -0,0 +1,194 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "../base64.h"
+
+/*
+		UserId Base64 Benchmark
+	> Times the text-protocol UserId transcoding, the enc64/dec64 the relay
+	used before against the fixed-width kernels of base64.h, after checking
+	that all of them agree on every generated id, and the kernels on every
+	random text of the alphabet as well.
+*/
+#define ITERATIONS 20000000
+#define IDS        4096  // Working set, a power of two
+#define TEXTS      2000000  // Random texts both decoders must accept or reject alike, with the same id
+
+/////////////////////
+// Previous Relay Functions
+/////////////////
+int enc64(const char* input, int len, char* output) {
+	static const char b64[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	int i;
+
+	if (len == 0) {
+		return 0;
+	}
+	char q, *p = (char*)output;
+	if (len == 1) {
+		i = 0;
+		*p++ = b64[(input[i] >> 2) & 0x3F];
+		q = (input[i++] & 0x03) << 4;
+		*p++ = b64[q | ((input[i] & 0xF0) >> 4)];
+		*p++ = '=';
+		*p++ = '=';
+	}
+	else {
+		for (i = 0; i < len - 2; i++) {
+			*p++ = b64[(input[i] >> 2) & 0x3F];
+			q = (input[i++] & 0x03) << 4;
+			*p++ = b64[q | ((input[i] & 0xF0) >> 4)];
+			q = (input[i++] & 0x0F) << 2;
+			*p++ = b64[q | ((input[i] & 0xC0) >> 6)];
+			*p++ = b64[input[i] & 0x3F];
+		}
+		if (i < len) {
+			*p++ = b64[(input[i] >> 2) & 0x3F];
+			if (i == (len - 1)) {
+				*p++ = b64[((input[i] & 0x3) << 4)];
+				*p++ = '=';
+			}
+			else {
+				q = (input[i++] & 0x3) << 4;
+				*p++ = b64[q | ((input[i] & 0xF0) >> 4)];
+				*p++ = b64[((input[i] & 0xF) << 2)];
+			}
+			*p++ = '=';
+		}
+	}
+	return p - output;
+}
+
+static int dec64(const char* in, int len, unsigned char* out) {
+	const static int T[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,
+		63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,-1,0,1,2,3,4,5,6,7,8,9,10,11,
+		12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,-1,26,27,28,29,30,31,32,
+		33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
+	int index = 0;
+	int val = 0, valb = -8;
+	for (int i = 0; i<len; i++) {
+		if (T[in[i]] == -1) break;
+		val = (val << 6) + T[in[i]];
+		valb += 6;
+		if (valb >= 0) {
+			out[index++] = (val >> valb) & 0xFF;
+			valb -= 8;
+		}
+	}
+	return index;
+}
+
+/////////////////////
+// Harness
+/////////////////
+std::vector<uint64_t> ids(IDS);
+std::vector<char> encoded(IDS * USERID64_LENGTH);
+volatile uint64_t sink;
+
+template <typename F>
+void Measure(const char* name, F f) {
+	auto start = std::chrono::steady_clock::now();
+	uint64_t checksum = 0;
+	for (uint32_t i = 0; i < ITERATIONS; i++) {
+		checksum += f(i & (IDS - 1));
+	}
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	sink = checksum;
+	printf("%-22s %7.2f ns/op\n", name, (double)elapsed / ITERATIONS);
+}
+
+int main() {
+	std::mt19937_64 random(1338);
+	for (auto &id : ids) {
+		id = random();
+	}
+	ids[0] = 0;
+	ids[1] = 0xFFFFFFFFFFFFFFFF;
+	printf("EncodeUserId64 and DecodeUserId64 run the %s kernels (uWS::Simd level %s)\n", uWS::Simd::level() >= uWS::Simd::SSE4 ? "SSSE3" : "scalar", uWS::Simd::levelName(uWS::Simd::level()));
+
+	// Every implementation must agree before anything is timed
+	for (uint32_t i = 0; i < IDS; i++) {
+		char reference[USERID64_LENGTH], scalar[USERID64_LENGTH], fast[USERID64_LENGTH];
+		enc64((const char*)&ids[i], 8, reference);
+		EncodeUserId64Scalar(&ids[i], scalar);
+		EncodeUserId64(&ids[i], fast);
+		uint64_t a = 0, b = 0, c = 0;
+		dec64(reference, USERID64_LENGTH, (unsigned char*)&a);
+		bool decoded = DecodeUserId64Scalar(reference, &b) && DecodeUserId64(reference, &c);
+		if (memcmp(reference, scalar, USERID64_LENGTH) || memcmp(reference, fast, USERID64_LENGTH) || !decoded || a != ids[i] || b != ids[i] || c != ids[i]) {
+			printf("Mismatch on %016llx\n", (unsigned long long)ids[i]);
+			return 1;
+		}
+		memcpy(&encoded[i * USERID64_LENGTH], reference, USERID64_LENGTH);
+	}
+	for (int c = 0; c < 256; c++) {
+		char text[USERID64_LENGTH];
+		memcpy(text, &encoded[0], USERID64_LENGTH);
+		text[c % 11] = (char)c;
+		uint64_t a = 0, b = 0;
+		const char* sextet = c ? strchr(USERID64_ALPHABET, c) : NULL;
+		bool valid = sextet && (c % 11 != 10 || !((sextet - USERID64_ALPHABET) & 3));
+		if (DecodeUserId64Scalar(text, &a) != valid || DecodeUserId64(text, &b) != valid || a != b) {
+			printf("Validation mismatch on character %d\n", c);
+			return 1;
+		}
+	}
+	for (uint32_t i = 0; i < TEXTS; i++) {
+		char text[USERID64_LENGTH], canonical[USERID64_LENGTH];
+		for (int c = 0; c < 11; c++) {
+			text[c] = USERID64_ALPHABET[random() & 0x3F];
+		}
+		text[11] = '=';
+		uint64_t a = 0, b = 0;
+		bool scalar = DecodeUserId64Scalar(text, &a), fast = DecodeUserId64(text, &b);
+		if (scalar) {
+			EncodeUserId64Scalar(&a, canonical);
+		}
+		if (scalar != fast || a != b || (scalar && memcmp(text, canonical, USERID64_LENGTH))) {
+			printf("Decoding mismatch on %.12s\n", text);
+			return 1;
+		}
+	}
+
+	Measure("enc64", [](uint32_t i) {
+		char out[USERID64_LENGTH];
+		enc64((const char*)&ids[i], 8, out);
+		return (uint64_t)(unsigned char)out[i % USERID64_LENGTH];
+	});
+	Measure("EncodeUserId64Scalar", [](uint32_t i) {
+		char out[USERID64_LENGTH];
+		EncodeUserId64Scalar(&ids[i], out);
+		return (uint64_t)(unsigned char)out[i % USERID64_LENGTH];
+	});
+	Measure("EncodeUserId64", [](uint32_t i) {
+		char out[USERID64_LENGTH];
+		EncodeUserId64(&ids[i], out);
+		return (uint64_t)(unsigned char)out[i % USERID64_LENGTH];
+	});
+	Measure("dec64", [](uint32_t i) {
+		uint64_t id;
+		dec64(&encoded[i * USERID64_LENGTH], USERID64_LENGTH, (unsigned char*)&id);
+		return id;
+	});
+	Measure("DecodeUserId64Scalar", [](uint32_t i) {
+		uint64_t id = 0;
+		DecodeUserId64Scalar(&encoded[i * USERID64_LENGTH], &id);
+		return id;
+	});
+	Measure("DecodeUserId64", [](uint32_t i) {
+		uint64_t id = 0;
+		DecodeUserId64(&encoded[i * USERID64_LENGTH], &id);
+		return id;
+	});
+	return 0;
+}
@@ -0,0 +1,6 @@
+#!/bin/sh
+cd "$(dirname "$0")"
+clang++ -O3 -march=native -fomit-frame-pointer -std=c++1z -o base64_bench base64_bench.cpp ../uws/Simd.cpp -I../uws
+clang++ -O3 -march=native -fomit-frame-pointer -std=c++1z -o relay_bench relay_bench.cpp ../uws/Socket.cpp ../uws/WebSocket.cpp ../uws/Room.cpp ../uws/Simd.cpp ../uws/Node.cpp ../uws/Networking.cpp ../uws/Hub.cpp ../uws/HTTPSocket.cpp ../uws/Group.cpp ../uws/Extensions.cpp ../uws/Epoll.cpp -I../uws -lz -pthread -lssl -luv -lcrypto
+clang++ -O3 -march=native -fomit-frame-pointer -std=c++1z -o protocol_bench protocol_bench.cpp ../uws/Socket.cpp ../uws/WebSocket.cpp ../uws/Room.cpp ../uws/Simd.cpp ../uws/Node.cpp ../uws/Networking.cpp ../uws/Hub.cpp ../uws/HTTPSocket.cpp ../uws/Group.cpp ../uws/Extensions.cpp ../uws/Epoll.cpp -I../uws -lz -pthread -lssl -luv -lcrypto
+clang++ -O3 -march=native -fomit-frame-pointer -std=c++1z -o zerocopy_bench zerocopy_bench.cpp ../uws/Socket.cpp ../uws/WebSocket.cpp ../uws/Room.cpp ../uws/Simd.cpp ../uws/Node.cpp ../uws/Networking.cpp ../uws/Hub.cpp ../uws/HTTPSocket.cpp ../uws/Group.cpp ../uws/Extensions.cpp ../uws/Epoll.cpp -I../uws -lz -pthread -lssl -luv -lcrypto
@@ -0,0 +1,404 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+#include <uWS.h>
+#include <Simd.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+/*
+		Protocol Benchmark
+	> Times the WebSocket protocol kernels of uWS in memory, no sockets
+	involved: framing (formatMessage), parsing (consume), unmasking, UTF-8
+	validation and the permessage-deflate codec of Hub.  Every kernel is
+	swept over payload sizes and reported in cycles per payload byte, the
+	best of REPEATS runs.  Results are checked before anything is timed.
+
+	Unmasking and UTF-8 validation run once per instruction set level the
+	cpu supports (scalar, sse4, avx2), the vector levels checked against
+	scalar first.  Everything else runs at the level picked at startup.
+
+	Cycles come from the time stamp counter, which ticks at the nominal
+	clock rate.  Pin the clock (or disable turbo) for comparable numbers.
+*/
+#define REPEATS      5
+#define TARGET_BYTES (64 * 1024 * 1024)  // Payload bytes per timed run
+#define STREAM_BYTES (256 * 1024)        // Frames consume parses per run
+#define MSS          1448                // Read size of the segmented consume runs
+#define MAX_PAYLOAD  16777216
+
+const size_t KernelSizes[] = { 16, 125, 1024, 16384, 65536, 1048576 };
+const size_t MessageSizes[] = { 16, 125, 1024, 16384, 65536 };
+const size_t DeflateSizes[] = { 64, 1024, 16384, 262144, 1048576 };
+
+volatile uint64_t sink;
+
+/////////////////////
+// Harness
+/////////////////
+// Fewest cycles of REPEATS runs of count calls to f
+template <typename F>
+double BestCycles(uint64_t count, F f) {
+	uint64_t best = UINT64_MAX, checksum = 0;
+	for (int r = 0; r < REPEATS; r++) {
+		uint64_t start = __rdtsc();
+		for (uint64_t i = 0; i < count; i++) {
+			checksum += f(i);
+		}
+		best = std::min<uint64_t>(best, __rdtsc() - start);
+	}
+	sink = checksum;
+	return (double)best;
+}
+
+inline uint64_t Iterations(size_t size) {
+	return std::max<uint64_t>(TARGET_BYTES / size, 1);
+}
+
+void Report(const char* kernel, const char* variant, size_t size, double cyclesPerByte) {
+	printf("%-16s %-22s %8zu %9.3f cycles/byte\n", kernel, variant, size, cyclesPerByte);
+}
+
+std::mt19937_64 Random(1338);
+
+std::vector<char> RandomBytes(size_t length) {
+	std::vector<char> bytes(length);
+	for (char &c : bytes) {
+		c = (char)Random();
+	}
+	return bytes;
+}
+
+// Chat text, one in every tenth character is a 2, 3 or 4-byte sequence if multilingual is set
+std::string ChatText(size_t length, bool multilingual) {
+	static const char* words[] = { "hello", "are", "you", "still", "there", "gg", "lobby", "ready", "ok", "lol", "map", "next" };
+	static const char* characters[] = { "\xd0\x9f", "\xd1\x8f", "\xc3\xa9", "\xe4\xbd\xa0", "\xe5\xa5\xbd", "\xe3\x81\x82", "\xf0\x9f\x98\x80" };
+	std::string text;
+	while (text.length() < length) {
+		if (multilingual && Random() % 10 == 0) {
+			text += characters[Random() % 7];
+		}
+		else {
+			text += words[Random() % 12];
+			text += ' ';
+		}
+	}
+	// Cut at a character boundary
+	size_t end = length;
+	while (end && ((unsigned char)text[end] & 0xC0) == 0x80) {
+		end--;
+	}
+	text.resize(end);
+	text.resize(length, ' ');
+	return text;
+}
+
+/////////////////////
+// Protocol Implementation
+/////////////////
+// Stands in for WebSocket as the Impl of WebSocketProtocol, it only collects what consume hands over
+template <bool isServer>
+struct BenchProtocol : uWS::WebSocketProtocol<isServer, BenchProtocol<isServer>> {
+	typedef uWS::WebSocketProtocol<isServer, BenchProtocol<isServer>> Protocol;
+	using Protocol::unmaskImprecise;
+	using Protocol::unmaskInplace;
+
+	static uint64_t delivered;   // Payload bytes handed to handleFragment
+	static std::string* copy;    // Receives the payloads while verifying
+	static bool failed;
+
+	static bool refusePayloadLength(uint64_t length, uWS::WebSocketState<isServer>* webSocketState) {
+		return length > MAX_PAYLOAD;
+	}
+
+	static bool setCompressed(uWS::WebSocketState<isServer>* webSocketState) {
+		return false;
+	}
+
+	static void forceClose(uWS::WebSocketState<isServer>* webSocketState) {
+		failed = true;
+	}
+
+	static bool handleFragment(char* data, size_t length, unsigned int remainingBytes, int opCode, bool fin, uWS::WebSocketState<isServer>* webSocketState) {
+		delivered += length;
+		if (copy) {
+			copy->append(data, length);
+		}
+		return false;
+	}
+};
+template <bool isServer> uint64_t BenchProtocol<isServer>::delivered = 0;
+template <bool isServer> std::string* BenchProtocol<isServer>::copy = nullptr;
+template <bool isServer> bool BenchProtocol<isServer>::failed = false;
+
+// Exposes the permessage-deflate codec of Hub
+struct BenchHub : uWS::Hub {
+	using uWS::Hub::deflate;
+	using uWS::Hub::inflate;
+};
+
+/////////////////////
+// Frame Streams
+/////////////////
+// Reads as recv would hand them to consume, each with the padding consume may write to
+struct FrameStream {
+	std::vector<char> pristine;
+	std::vector<char> work;
+	std::vector<size_t> offsets;
+	std::vector<size_t> lengths;
+	std::string payloads;  // Everything consume must deliver
+};
+
+// Frames of messageSize bytes, in fragments per message, as sent to isServer, cut into reads of readSize
+template <bool isServer>
+FrameStream BuildStream(size_t messageSize, int fragments, size_t readSize) {
+	typedef BenchProtocol<!isServer> Sender;
+	FrameStream stream;
+	std::string frames;
+	std::vector<char> frame(messageSize + 14);
+	while (frames.length() < STREAM_BYTES || frames.empty()) {
+		std::vector<char> message = RandomBytes(messageSize);
+		size_t fragmentSize = (messageSize + fragments - 1) / fragments;
+		for (size_t offset = 0; offset < messageSize; offset += fragmentSize) {
+			size_t length = std::min(fragmentSize, messageSize - offset);
+			size_t frameLength = Sender::formatMessage(frame.data(), message.data() + offset, length, uWS::OpCode::BINARY, length, false);
+			bool first = !offset, last = offset + length == messageSize;
+			frame[0] = (char)((last ? 128 : 0) | (first ? uWS::OpCode::BINARY : 0));
+			frames.append(frame.data(), frameLength);
+		}
+		stream.payloads.append(message.data(), messageSize);
+	}
+
+	const size_t pre = BenchProtocol<isServer>::CONSUME_PRE_PADDING, post = BenchProtocol<isServer>::CONSUME_POST_PADDING;
+	for (size_t offset = 0; offset < frames.length(); offset += readSize) {
+		size_t length = std::min(readSize, frames.length() - offset);
+		stream.offsets.push_back(stream.pristine.size() + pre);
+		stream.lengths.push_back(length);
+		stream.pristine.resize(stream.pristine.size() + pre);
+		stream.pristine.insert(stream.pristine.end(), frames.data() + offset, frames.data() + offset + length);
+		stream.pristine.resize(stream.pristine.size() + post);
+	}
+	stream.work = stream.pristine;
+	return stream;
+}
+
+// Feeds every read of stream to consume
+template <bool isServer>
+void ConsumeStream(FrameStream &stream) {
+	uWS::WebSocketState<isServer> state;
+	for (size_t i = 0; i < stream.offsets.size(); i++) {
+		BenchProtocol<isServer>::consume(stream.work.data() + stream.offsets[i], (unsigned int)stream.lengths[i], &state);
+	}
+}
+
+template <bool isServer>
+bool MeasureConsume(size_t messageSize, int fragments, size_t readSize) {
+	typedef BenchProtocol<isServer> Receiver;
+	FrameStream stream = BuildStream<isServer>(messageSize, fragments, readSize);
+
+	std::string copy;
+	Receiver::copy = &copy;
+	ConsumeStream<isServer>(stream);
+	Receiver::copy = nullptr;
+	if (Receiver::failed || copy != stream.payloads) {
+		printf("consume mismatch for %zu byte messages in %d fragments\n", messageSize, fragments);
+		return false;
+	}
+
+	// The reads are unmasked in place, so they are restored before every (untimed) pass
+	uint64_t iterations = std::max<uint64_t>(TARGET_BYTES / stream.payloads.length(), 1);
+	uint64_t best = UINT64_MAX;
+	for (int r = 0; r < REPEATS; r++) {
+		uint64_t cycles = 0;
+		for (uint64_t i = 0; i < iterations; i++) {
+			memcpy(stream.work.data(), stream.pristine.data(), stream.pristine.size());
+			uint64_t start = __rdtsc();
+			ConsumeStream<isServer>(stream);
+			cycles += __rdtsc() - start;
+		}
+		best = std::min(best, cycles);
+	}
+
+	char variant[32];
+	snprintf(variant, sizeof(variant), "%s/%dfrag/%s", isServer ? "masked" : "unmasked", fragments, readSize == MSS ? "mss" : "whole");
+	Report("consume", variant, messageSize, best / ((double)iterations * stream.payloads.length()));
+	return true;
+}
+
+/////////////////////
+// Kernels
+/////////////////
+// Every vector level against scalar: unmasking at all shifts and lengths up to 300, UTF-8 on
+// chat text with bytes replaced by the ones that start or break sequences
+bool CheckSimd() {
+	static const unsigned char breakers[] = { 0x80, 0x8F, 0x90, 0x9F, 0xA0, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF, 0xE0, 0xED, 0xEF, 0xF0, 0xF4, 0xF5, 0xFF };
+	const uWS::Simd::Level best = uWS::Simd::supported();
+	char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+	for (int level = uWS::Simd::SSE4; level <= best; level++) {
+		for (size_t length = 0; length <= 300; length++) {
+			for (size_t shift = 0; shift < 16; shift++) {
+				std::vector<char> expected = RandomBytes(length + shift + 4), actual = expected;
+				uWS::Simd::select(uWS::Simd::SCALAR);
+				uWS::Simd::unmask(expected.data(), expected.data() + shift, mask, length);
+				uWS::Simd::select((uWS::Simd::Level)level);
+				uWS::Simd::unmask(actual.data(), actual.data() + shift, mask, length);
+				if (actual != expected) {
+					printf("%s unmask differs from scalar at length %zu shift %zu\n", uWS::Simd::levelName((uWS::Simd::Level)level), length, shift);
+					return false;
+				}
+			}
+		}
+		for (int i = 0; i < 100000; i++) {
+			std::string text = ChatText(Random() % 200, true);
+			for (int n = Random() % 3; n && text.length(); n--) {
+				text[Random() % text.length()] = (char)breakers[Random() % sizeof(breakers)];
+			}
+			uWS::Simd::select(uWS::Simd::SCALAR);
+			bool expected = uWS::Simd::isValidUtf8((unsigned char*)text.data(), text.length());
+			uWS::Simd::select((uWS::Simd::Level)level);
+			if (uWS::Simd::isValidUtf8((unsigned char*)text.data(), text.length()) != expected) {
+				printf("%s isValidUtf8 differs from scalar on %zu bytes\n", uWS::Simd::levelName((uWS::Simd::Level)level), text.length());
+				return false;
+			}
+		}
+	}
+	uWS::Simd::select(best);
+	return true;
+}
+
+void MeasureUnmask() {
+	typedef BenchProtocol<uWS::SERVER> Protocol;
+	for (int level = uWS::Simd::SCALAR; level <= uWS::Simd::supported(); level++) {
+		const char* name = uWS::Simd::levelName(uWS::Simd::select((uWS::Simd::Level)level));
+		char variant[32];
+		for (size_t size : KernelSizes) {
+			std::vector<char> buffer = RandomBytes(size + 8);
+			char mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+			uint64_t iterations = Iterations(size);
+
+			// As consumeMessage calls it, moving the payload over the 4 mask bytes
+			double cycles = BestCycles(iterations, [&](uint64_t i) {
+				Protocol::unmaskImprecise(buffer.data(), buffer.data() + 4, mask, (unsigned int)size);
+				return (uint64_t)(unsigned char)buffer[i % size];
+			});
+			snprintf(variant, sizeof(variant), "shift 4/%s", name);
+			Report("unmaskImprecise", variant, size, cycles / (iterations * size));
+
+			cycles = BestCycles(iterations, [&](uint64_t i) {
+				Protocol::unmaskInplace(buffer.data(), buffer.data() + (size + 3) / 4 * 4, mask);
+				return (uint64_t)(unsigned char)buffer[i % size];
+			});
+			Report("unmaskInplace", name, size, cycles / (iterations * size));
+		}
+	}
+	uWS::Simd::select(uWS::Simd::supported());
+}
+
+bool MeasureUtf8() {
+	typedef BenchProtocol<uWS::SERVER> Protocol;
+	const char* variants[] = { "ascii", "multilingual" };
+	for (int level = uWS::Simd::SCALAR; level <= uWS::Simd::supported(); level++) {
+		const char* name = uWS::Simd::levelName(uWS::Simd::select((uWS::Simd::Level)level));
+		char variant[32];
+		for (int multilingual = 0; multilingual < 2; multilingual++) {
+			snprintf(variant, sizeof(variant), "%s/%s", variants[multilingual], name);
+			for (size_t size : KernelSizes) {
+				std::string text = ChatText(size, multilingual);
+				if (!Protocol::isValidUtf8((unsigned char*)&text[0], text.length())) {
+					printf("isValidUtf8 rejects valid %s text\n", variant);
+					return false;
+				}
+				uint64_t iterations = Iterations(size);
+				double cycles = BestCycles(iterations, [&](uint64_t i) {
+					return (uint64_t)Protocol::isValidUtf8((unsigned char*)&text[0], text.length());
+				});
+				Report("isValidUtf8", variant, size, cycles / (iterations * size));
+			}
+		}
+	}
+	uWS::Simd::select(uWS::Simd::supported());
+	return true;
+}
+
+template <bool isServer>
+void MeasureFormat() {
+	for (size_t size : KernelSizes) {
+		std::vector<char> payload = RandomBytes(size);
+		std::vector<char> frame(size + 14);
+		uint64_t iterations = Iterations(size);
+		double cycles = BestCycles(iterations, [&](uint64_t i) {
+			return (uint64_t)BenchProtocol<isServer>::formatMessage(frame.data(), payload.data(), size, uWS::OpCode::BINARY, size, false);
+		});
+		Report("formatMessage", isServer ? "server" : "client (masked)", size, cycles / (iterations * size));
+	}
+}
+
+bool MeasureDeflate() {
+	BenchHub hub;
+	for (size_t size : DeflateSizes) {
+		std::string text = ChatText(size, true);
+
+		// Hub::deflate returns its zlibBuffer, which inflate overwrites
+		size_t compressedLength = size;
+		char* deflated = hub.deflate(&text[0], compressedLength, nullptr);
+		std::string compressed(deflated, compressedLength);
+		size_t inflatedLength = compressedLength;
+		char* inflated = hub.inflate(&compressed[0], inflatedLength, MAX_PAYLOAD);
+		if (!inflated || std::string(inflated, inflatedLength) != text) {
+			printf("inflate does not restore %zu deflated bytes\n", size);
+			return false;
+		}
+
+		uint64_t iterations = std::max<uint64_t>(Iterations(size) / 16, 1);
+		double cycles = BestCycles(iterations, [&](uint64_t i) {
+			size_t length = size;
+			hub.deflate(&text[0], length, nullptr);
+			return (uint64_t)length;
+		});
+		Report("Hub::deflate", "chat", size, cycles / (iterations * size));
+
+		cycles = BestCycles(iterations, [&](uint64_t i) {
+			size_t length = compressed.length();
+			hub.inflate(&compressed[0], length, MAX_PAYLOAD);
+			return (uint64_t)length;
+		});
+		Report("Hub::inflate", "chat", size, cycles / (iterations * size));
+	}
+	return true;
+}
+
+int main() {
+	if (!CheckSimd()) {
+		return 1;
+	}
+	printf("%-16s %-22s %8s %9s\n", "kernel", "variant", "bytes", "cost");
+	MeasureUnmask();
+	if (!MeasureUtf8()) {
+		return 1;
+	}
+	MeasureFormat<uWS::SERVER>();
+	MeasureFormat<uWS::CLIENT>();
+
+	// Masked frames parsed by the server, unmasked ones by the client
+	for (size_t size : MessageSizes) {
+		for (int fragments : { 1, 4 }) {
+			for (size_t readSize : { (size_t)STREAM_BYTES * 2, (size_t)MSS }) {
+				if (!MeasureConsume<uWS::SERVER>(size, fragments, readSize) || !MeasureConsume<uWS::CLIENT>(size, fragments, readSize)) {
+					return 1;
+				}
+			}
+		}
+	}
+
+	if (!MeasureDeflate()) {
+		return 1;
+	}
+	return 0;
+}
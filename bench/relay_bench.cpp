@@ -0,0 +1,687 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <uWS.h>
+#include "../base64.h"
+
+/*
+		Relay Load Generator
+	> Opens client sockets against a running relay from several Hub threads,
+	drives one scenario at a fixed rate and reports delivered messages per
+	second, egress and delivery latency percentiles.
+
+	Every sender follows a schedule of intended send times, and messages
+	carry their intended time instead of the time they actually left.  A
+	stall of the relay (or of this client) is thereby charged to every
+	message that should have been sent during it.  Closed-loop scenarios
+	(ping-pong, churn) send overdue messages back to back until they are
+	back on schedule.  The percentiles are free of coordinated omission.
+
+	Sends are paced by a TICK_MS timer, latencies below one tick are not
+	resolved.  The relay's rate limits apply, senders above their budget
+	are disconnected (reported as closed by the relay).
+*/
+
+/*
+		Scenarios
+	> broadcast  Senders broadcast to their channel, every other member records
+	pingpong   Pairs of clients bounce private messages, the pinger records the round trip
+	spy        Like broadcast, 're_globl' spies listening for channel messages record too
+	variables  Senders set a channel variable that every other member watches
+	churn      Every client connects, joins and disconnects, the join reply records
+
+	--text switches broadcast, pingpong and spy to text messages.
+*/
+#define DEFAULT_URI        "ws://127.0.0.1:1338"
+#define DEFAULT_THREADS    4
+#define DEFAULT_CLIENTS    1000
+#define DEFAULT_CHANNELS   10
+#define DEFAULT_SENDERS    1            // Per channel
+#define DEFAULT_SPIES      4
+#define DEFAULT_RATE       100          // Messages per second per sender, connections per second per client (churn)
+#define DEFAULT_SIZE       64           // Payload bytes after the target UserId, timestamp included
+#define DEFAULT_WARMUP_S   2
+#define DEFAULT_DURATION_S 10
+#define DEFAULT_PASSWORD   "metalgear"  // Authenticated sessions get RATE_AUTHENTICATED times the relay's budget
+
+#define TICK_MS         1      // Scheduler resolution
+#define JOIN_TIMEOUT_MS 30000  // Clients still not joined after this abort the run
+#define DRAIN_MS        1000   // Messages sent before the end of the measurement may arrive this much later
+
+// RELAY PROTOCOL (see relay.cpp)
+#define RE_BROADCAST_TARGET 0xFFFFFFFFFFFFFFFF
+#define RE_RELAY_TARGET     0x0000000000000000
+#define SPY_CHANNEL         "re_globl"
+#define LISTEN_CHANNEL      0b0001  // Message Mode Mask bit for channel messages
+#define VARIABLE_KEY        "bench"
+#define VARIABLE_PUSH       204     // Reply opcode of watched variables
+#define TEXT_STAMP_LENGTH   16      // Hex digits
+
+/////////////////////
+// CONFIGURATION
+/////////////////
+enum Scenario {
+	ScenarioBroadcast,
+	ScenarioPingPong,
+	ScenarioSpy,
+	ScenarioVariables,
+	ScenarioChurn,
+	SCENARIOS
+};
+const char* ScenarioNames[SCENARIOS] = { "broadcast", "pingpong", "spy", "variables", "churn" };
+
+struct Options {
+	std::string uri = DEFAULT_URI;
+	Scenario scenario = ScenarioBroadcast;
+	bool text = false;
+	int threads = DEFAULT_THREADS;
+	int clients = DEFAULT_CLIENTS;
+	int channels = DEFAULT_CHANNELS;
+	int senders = DEFAULT_SENDERS;
+	int spies = DEFAULT_SPIES;
+	int rate = DEFAULT_RATE;
+	int size = DEFAULT_SIZE;
+	int warmup = DEFAULT_WARMUP_S;
+	int duration = DEFAULT_DURATION_S;
+	std::string password = DEFAULT_PASSWORD;
+};
+Options Config;
+
+// Receivers are reported separately by role
+enum Role {
+	RoleMember,
+	RoleSpy,
+	ROLES
+};
+const char* RoleNames[ROLES] = { "delivered", "spied" };
+
+/////////////////////
+// GLOBALS
+/////////////////
+enum Phase {
+	PhaseConnecting,  // Clients connect and join, nothing is sent
+	PhaseRunning,     // Senders follow their schedule
+	PhaseStopping     // Threads terminate their sockets and leave their loop
+};
+std::atomic<int> CurrentPhase{PhaseConnecting};
+std::atomic<int> Joined{0};
+std::atomic<int> Failed{0};
+
+// Steady clock (ns), written before PhaseRunning is published
+int64_t ScheduleStart;
+int64_t MeasureStart;
+int64_t MeasureEnd;
+int64_t Interval;
+
+/////////////////////
+// CLIENTS
+/////////////////
+struct BenchThread;
+
+struct Client {
+	BenchThread* thread;
+	int global;                               // Index among all clients
+	int channel;
+	Role role = RoleMember;
+	bool sender = false;
+	bool pinger = false;                      // Ping-pong: sends pings to peer, otherwise echoes them
+	Client* peer = nullptr;
+	uWS::WebSocket<uWS::CLIENT>* ws = nullptr;
+	uint64_t userId = 0;                      // 0 until joined
+	bool outstanding = false;                 // Ping or churn connection in flight
+	int64_t next = 0;                         // Intended time of the next send
+	int64_t connectAt = 0;                    // Intended time of the churn connection in flight
+};
+
+struct BenchThread {
+	int index;
+	uWS::Hub* hub = nullptr;
+	uS::Async* keepAlive = nullptr;  // Holds the loop open while churn has no socket
+	uS::Timer* ticker = nullptr;
+	std::vector<Client> clients;
+	std::vector<Client*> senders;
+	std::string message;             // Scratch for outgoing messages
+
+	// Only messages intended within the measurement count
+	uint64_t sent = 0;
+	uint64_t received[ROLES] = {};
+	uint64_t receivedBytes[ROLES] = {};
+	uS::LatencyHistogram latency[ROLES];
+
+	uint64_t closed = 0;  // Sockets the relay closed while running
+	int lastCloseCode = 0;
+	uint64_t errors = 0;  // Failed connections
+};
+
+
+/////////////////////
+// MESSAGES
+/////////////////
+inline int StampLength() {
+	return Config.text ? TEXT_STAMP_LENGTH : 8;
+}
+
+// Builds [target][stamp][padding] of Config.size payload bytes into thread->message
+void BuildMessage(BenchThread* thread, uint64_t target, int64_t stamp) {
+	std::string &message = thread->message;
+	message.clear();
+	if (Config.text) {
+		char prefix[USERID64_LENGTH];
+		char digits[TEXT_STAMP_LENGTH + 1];
+		EncodeUserId64(&target, prefix);
+		snprintf(digits, sizeof(digits), "%016llx", (unsigned long long)stamp);
+		message.append(prefix, USERID64_LENGTH);
+		message.append(digits, TEXT_STAMP_LENGTH);
+		message.resize(USERID64_LENGTH + Config.size, 'x');
+	}
+	else {
+		message.append((const char*)&target, 8);
+		message.append((const char*)&stamp, 8);
+		message.resize(8 + Config.size, 'x');
+	}
+}
+
+// Sends [RE_RELAY_TARGET][op][data] from c
+void SendRelayOp(Client* c, uint8_t op, const void* data, size_t length) {
+	std::string &message = c->thread->message;
+	uint64_t target = RE_RELAY_TARGET;
+	message.assign((const char*)&target, 8);
+	message += (char)op;
+	message.append((const char*)data, length);
+	c->ws->send(message.data(), message.length(), uWS::OpCode::BINARY);
+}
+
+// Sets VARIABLE_KEY of the channel of c to [stamp][padding]
+void SendVariable(Client* c, int64_t stamp) {
+	std::string value;
+	value += (char)(sizeof(VARIABLE_KEY) - 1);
+	value += VARIABLE_KEY;
+	value.append((const char*)&stamp, 8);
+	value.resize(1 + sizeof(VARIABLE_KEY) - 1 + std::max(Config.size, 8), 'x');
+	SendRelayOp(c, 4, value.data(), value.length());
+}
+
+int64_t ParseTextStamp(const char* digits) {
+	uint64_t stamp = 0;
+	for (int i = 0; i < TEXT_STAMP_LENGTH; i++) {
+		char d = digits[i];
+		stamp = (stamp << 4) | (uint64_t)(d <= '9' ? d - '0' : d - 'a' + 10);
+	}
+	return (int64_t)stamp;
+}
+
+// Counts a message received by a client of thread, intended to be sent at stamp
+void Record(BenchThread* thread, Role role, int64_t stamp, size_t length) {
+	if (stamp < MeasureStart || stamp >= MeasureEnd) {
+		return;
+	}
+	thread->received[role]++;
+	thread->receivedBytes[role] += length;
+	thread->latency[role].record((uint64_t)std::max<int64_t>(uS::Latency::now() - stamp, 0));
+}
+
+
+/////////////////////
+// SCHEDULE
+/////////////////
+// Sends whatever the schedule of c asks for by now
+void SendDue(BenchThread* thread, Client* c, int64_t now) {
+	while (c->next <= now) {
+		switch (Config.scenario) {
+			case ScenarioPingPong: {
+				if (!c->ws || c->outstanding || !c->peer->userId) {
+					return;
+				}
+				BuildMessage(thread, c->peer->userId, c->next);
+				c->ws->send(thread->message.data(), thread->message.length(), Config.text ? uWS::OpCode::TEXT : uWS::OpCode::BINARY);
+				c->outstanding = true;
+				break;
+			}
+			case ScenarioVariables: {
+				if (!c->ws) {
+					return;
+				}
+				SendVariable(c, c->next);
+				break;
+			}
+			case ScenarioChurn: {
+				if (c->outstanding) {
+					return;
+				}
+				c->connectAt = c->next;
+				c->outstanding = true;
+				thread->hub->connect(Config.uri, c);
+				break;
+			}
+			default: {
+				if (!c->ws) {
+					return;
+				}
+				BuildMessage(thread, RE_BROADCAST_TARGET, c->next);
+				c->ws->send(thread->message.data(), thread->message.length(), Config.text ? uWS::OpCode::TEXT : uWS::OpCode::BINARY);
+				break;
+			}
+		}
+		if (c->next >= MeasureStart && c->next < MeasureEnd) {
+			thread->sent++;
+		}
+		c->next += Interval;
+	}
+}
+
+// Terminates every socket of thread so its loop runs out of polls
+void StopThread(BenchThread* thread) {
+	thread->ticker->stop();
+	thread->keepAlive->close();
+	for (Client &c : thread->clients) {
+		if (c.ws) {
+			c.ws->terminate();
+		}
+	}
+}
+
+
+/////////////////////
+// CLIENT EVENTS
+/////////////////
+// Handles the UserId the relay sends after joining
+void OnJoined(BenchThread* thread, Client* c, uWS::WebSocket<uWS::CLIENT>* ws, const char* message) {
+	memcpy(&c->userId, message, 8);
+	if (Config.scenario == ScenarioChurn) {
+		Record(thread, RoleMember, c->connectAt, 8);
+		ws->close();
+		return;
+	}
+
+	if (Config.password.length()) {
+		SendRelayOp(c, 0, Config.password.data(), Config.password.length());
+	}
+	if (c->role == RoleSpy) {
+		char mode = LISTEN_CHANNEL;
+		SendRelayOp(c, 1, &mode, 1);
+	}
+	if (Config.scenario == ScenarioVariables && !c->sender) {
+		std::string watch(1, '\0');
+		watch += VARIABLE_KEY;
+		SendRelayOp(c, 11, watch.data(), watch.length());
+	}
+	Joined++;
+}
+
+void OnMessage(uWS::WebSocket<uWS::CLIENT>* ws, char* message, size_t length, uWS::OpCode code) {
+	Client* c = (Client*)ws->getUserData();
+	BenchThread* thread = c->thread;
+	if (!c->userId) {
+		if (code == uWS::OpCode::BINARY && length == 8) {
+			OnJoined(thread, c, ws, message);
+		}
+		return;
+	}
+
+	// Pongs go back unchanged, the sender prefix the relay wrote is the pinger
+	bool echo = Config.scenario == ScenarioPingPong && !c->pinger;
+	if (code == uWS::OpCode::TEXT) {
+		if (length < USERID64_LENGTH + TEXT_STAMP_LENGTH) {
+			return;
+		}
+		if (echo) {
+			ws->send(message, length, code);
+			return;
+		}
+		Record(thread, c->role, ParseTextStamp(message + USERID64_LENGTH), length);
+	}
+	else {
+		uint64_t sender;
+		int64_t stamp;
+		if (length < 16) {
+			return;
+		}
+		memcpy(&sender, message, 8);
+		if (sender == RE_RELAY_TARGET) {
+			// [RE_RELAY_TARGET][204][version][key length][key][stamp]
+			if ((uint8_t)message[8] != VARIABLE_PUSH || length < 18) {
+				return;
+			}
+			size_t value = 18 + (uint8_t)message[17];
+			if (value + 8 > length) {
+				return;
+			}
+			memcpy(&stamp, message + value, 8);
+			Record(thread, c->role, stamp, length);
+			return;
+		}
+		if (echo) {
+			ws->send(message, length, code);
+			return;
+		}
+		memcpy(&stamp, message + 8, 8);
+		Record(thread, c->role, stamp, length);
+	}
+
+	if (Config.scenario == ScenarioPingPong) {
+		c->outstanding = false;
+		SendDue(thread, c, uS::Latency::now());
+	}
+}
+
+
+/////////////////////
+// THREADS
+/////////////////
+// Assigns channels and roles to the clients of thread (global index = thread + threads * local index)
+void SetupClients(BenchThread* thread) {
+	int count = Config.clients / Config.threads + (thread->index < Config.clients % Config.threads);
+	thread->clients.resize(count);
+	for (int i = 0; i < count; i++) {
+		Client &c = thread->clients[i];
+		c.thread = thread;
+		c.global = thread->index + Config.threads * i;
+
+		int member = c.global;
+		if (Config.scenario == ScenarioSpy) {
+			c.role = c.global < Config.spies ? RoleSpy : RoleMember;
+			member -= Config.spies;
+		}
+		c.channel = member % Config.channels;
+		switch (Config.scenario) {
+			case ScenarioPingPong: {
+				c.pinger = !(i & 1) && i + 1 < count;
+				if (c.pinger) {
+					c.peer = &thread->clients[i + 1];
+				}
+				c.sender = c.pinger;
+				break;
+			}
+			case ScenarioChurn: {
+				c.sender = true;
+				break;
+			}
+			default: {
+				c.sender = c.role == RoleMember && member / Config.channels < Config.senders;
+				break;
+			}
+		}
+		if (c.sender) {
+			thread->senders.push_back(&c);
+		}
+	}
+}
+
+void RunThread(BenchThread* thread) {
+	uWS::Hub h;
+	thread->hub = &h;
+
+	thread->keepAlive = new uS::Async(h.getLoop());
+	thread->keepAlive->start([](uS::Async*) {});
+
+	h.onConnection([](uWS::WebSocket<uWS::CLIENT>* ws, uWS::HttpRequest req) {
+		Client* c = (Client*)ws->getUserData();
+		if (CurrentPhase.load(std::memory_order_acquire) == PhaseStopping) {
+			ws->terminate();
+			return;
+		}
+		c->ws = ws;
+
+		char channel[16];
+		int length = c->role == RoleSpy ? snprintf(channel, sizeof(channel), SPY_CHANNEL) : snprintf(channel, sizeof(channel), "bench%d", c->channel);
+		ws->send(channel, length, uWS::OpCode::BINARY);
+	});
+
+	h.onMessage(OnMessage);
+
+	h.onDisconnection([](uWS::WebSocket<uWS::CLIENT>* ws, int code, char* message, size_t length) {
+		Client* c = (Client*)ws->getUserData();
+		c->ws = nullptr;
+		c->userId = 0;
+		if (Config.scenario == ScenarioChurn) {
+			c->outstanding = false;
+		}
+		else if (CurrentPhase.load(std::memory_order_acquire) != PhaseStopping) {
+			c->thread->closed++;
+			c->thread->lastCloseCode = code;
+		}
+	});
+
+	h.onError([](void* user) {
+		Client* c = (Client*)user;
+		c->thread->errors++;
+		if (Config.scenario == ScenarioChurn) {
+			c->outstanding = false;
+		}
+		else {
+			Failed++;
+		}
+	});
+
+	thread->ticker = new uS::Timer(h.getLoop());
+	thread->ticker->setData(thread);
+	thread->ticker->start([](uS::Timer* timer) {
+		BenchThread* thread = (BenchThread*)timer->getData();
+		switch (CurrentPhase.load(std::memory_order_acquire)) {
+			case PhaseRunning: {
+				int64_t now = uS::Latency::now();
+				for (Client* c : thread->senders) {
+					SendDue(thread, c, now);
+				}
+				break;
+			}
+			case PhaseStopping: {
+				StopThread(thread);
+				break;
+			}
+		}
+	}, TICK_MS, TICK_MS);
+
+	if (Config.scenario != ScenarioChurn) {
+		for (Client &c : thread->clients) {
+			h.connect(Config.uri, &c);
+		}
+	}
+	h.run();
+}
+
+
+/////////////////////
+// REPORT
+/////////////////
+// Highest value of the bucket holding quantile q of counts, in microseconds
+double Percentile(const std::vector<uint64_t> &counts, uint64_t total, double q) {
+	uint64_t rank = std::max<uint64_t>((uint64_t)(q * total + 0.5), 1), seen = 0;
+	for (int i = 0; i < uS::LatencyHistogram::BUCKETS; i++) {
+		seen += counts[i];
+		if (seen >= rank) {
+			return uS::LatencyHistogram::highestValue(i) / 1e3;
+		}
+	}
+	return 0;
+}
+
+void Report(std::vector<BenchThread*> &threads) {
+	double seconds = Config.duration;
+	uint64_t sent = 0, closed = 0, errors = 0;
+	int lastCloseCode = 0;
+	for (BenchThread* thread : threads) {
+		sent += thread->sent;
+		closed += thread->closed;
+		errors += thread->errors;
+		lastCloseCode = thread->lastCloseCode ? thread->lastCloseCode : lastCloseCode;
+	}
+
+	printf("%s (%s), %d threads, %d clients, %d channels, %d/s per sender, %d byte payloads\n", ScenarioNames[Config.scenario],
+		Config.text ? "text" : "binary", Config.threads, Config.clients, Config.channels, Config.rate, Config.size);
+	printf("%-10s %12.0f %s/s\n", "sent", sent / seconds, Config.scenario == ScenarioChurn ? "connections" : "msg");
+
+	for (int role = 0; role < ROLES; role++) {
+		std::vector<uint64_t> counts(uS::LatencyHistogram::BUCKETS);
+		uint64_t received = 0, bytes = 0, total = 0;
+		for (BenchThread* thread : threads) {
+			received += thread->received[role];
+			bytes += thread->receivedBytes[role];
+			for (int i = 0; i < uS::LatencyHistogram::BUCKETS; i++) {
+				counts[i] += thread->latency[role].counts[i].load(std::memory_order_relaxed);
+			}
+		}
+		total = received;
+		if (!total) {
+			continue;
+		}
+
+		double max = 0;
+		for (int i = uS::LatencyHistogram::BUCKETS - 1; i >= 0; i--) {
+			if (counts[i]) {
+				max = uS::LatencyHistogram::highestValue(i) / 1e3;
+				break;
+			}
+		}
+		printf("%-10s %12.0f msg/s %10.2f MB/s egress\n", RoleNames[role], received / seconds, bytes / seconds / 1e6);
+		printf("%-10s p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  p99.99 %.1f  max %.1f (us)\n", "latency", Percentile(counts, total, 0.5),
+			Percentile(counts, total, 0.9), Percentile(counts, total, 0.99), Percentile(counts, total, 0.999), Percentile(counts, total, 0.9999), max);
+	}
+
+	if (closed || errors) {
+		printf("%llu sockets closed by the relay (last code %d), %llu failed connections\n", (unsigned long long)closed, lastCloseCode, (unsigned long long)errors);
+	}
+}
+
+
+/////////////////////
+// COMMAND LINE
+/////////////////
+void Usage() {
+	printf("Usage: relay_bench [options]\n"
+		"  --uri URI            Relay to connect to (%s)\n"
+		"  --scenario NAME      broadcast, pingpong, spy, variables or churn (broadcast)\n"
+		"  --text               Text instead of binary messages (broadcast, pingpong, spy)\n"
+		"  --threads N          Hub threads (%d)\n"
+		"  --clients N          Client sockets over all threads (%d)\n"
+		"  --channels N         Channels the clients are spread over (%d)\n"
+		"  --senders N          Senders per channel (%d)\n"
+		"  --spies N            're_globl' spies of the spy scenario (%d)\n"
+		"  --rate N             Messages per second per sender, connections per second per client for churn (%d)\n"
+		"  --size N             Payload bytes after the target UserId (%d)\n"
+		"  --warmup S           Seconds sent before measuring (%d)\n"
+		"  --duration S         Seconds measured (%d)\n"
+		"  --password TEXT      Relay credential for the authenticated rate budget, empty for none (%s)\n",
+		DEFAULT_URI, DEFAULT_THREADS, DEFAULT_CLIENTS, DEFAULT_CHANNELS, DEFAULT_SENDERS, DEFAULT_SPIES, DEFAULT_RATE, DEFAULT_SIZE,
+		DEFAULT_WARMUP_S, DEFAULT_DURATION_S, DEFAULT_PASSWORD);
+}
+
+bool ParseOptions(int argc, char* argv[]) {
+	for (int i = 1; i < argc; i++) {
+		std::string name = argv[i];
+		if (name == "--text") {
+			Config.text = true;
+			continue;
+		}
+		if (i + 1 >= argc) {
+			return false;
+		}
+		const char* value = argv[++i];
+		if (name == "--uri") {
+			Config.uri = value;
+		}
+		else if (name == "--scenario") {
+			int scenario = 0;
+			while (scenario < SCENARIOS && strcmp(value, ScenarioNames[scenario])) {
+				scenario++;
+			}
+			if (scenario == SCENARIOS) {
+				return false;
+			}
+			Config.scenario = (Scenario)scenario;
+		}
+		else if (name == "--threads") { Config.threads = atoi(value); }
+		else if (name == "--clients") { Config.clients = atoi(value); }
+		else if (name == "--channels") { Config.channels = atoi(value); }
+		else if (name == "--senders") { Config.senders = atoi(value); }
+		else if (name == "--spies") { Config.spies = atoi(value); }
+		else if (name == "--rate") { Config.rate = atoi(value); }
+		else if (name == "--size") { Config.size = atoi(value); }
+		else if (name == "--warmup") { Config.warmup = atoi(value); }
+		else if (name == "--duration") { Config.duration = atoi(value); }
+		else if (name == "--password") { Config.password = value; }
+		else {
+			return false;
+		}
+	}
+
+	if (Config.scenario == ScenarioVariables || Config.scenario == ScenarioChurn) {
+		Config.text = false;
+	}
+	Config.size = std::max(Config.size, StampLength());
+	return Config.threads > 0 && Config.clients >= Config.threads && Config.channels > 0 && Config.rate > 0 && Config.warmup >= 0 &&
+		Config.duration > 0 && Config.spies >= 0 && Config.spies < Config.clients;
+}
+
+
+/////////////////////
+// MAIN FUNCTION
+/////////////////
+int main(int argc, char* argv[])
+{
+	if (!ParseOptions(argc, argv)) {
+		Usage();
+		return 1;
+	}
+	if (Config.scenario != ScenarioSpy) {
+		Config.spies = 0;
+	}
+
+	std::vector<BenchThread*> threads(Config.threads);
+	std::vector<std::thread*> handles(Config.threads);
+	for (int i = 0; i < Config.threads; i++) {
+		threads[i] = new BenchThread();
+		threads[i]->index = i;
+		SetupClients(threads[i]);
+	}
+
+	// Every client joins first, churn connects on its own schedule
+	int64_t connectStart = uS::Latency::now();
+	int expected = Config.scenario == ScenarioChurn ? 0 : Config.clients;
+	for (int i = 0; i < Config.threads; i++) {
+		handles[i] = new std::thread(RunThread, threads[i]);
+	}
+	while (Joined + Failed < expected && uS::Latency::now() - connectStart < JOIN_TIMEOUT_MS * 1000000LL) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	bool joined = Joined == expected;
+	if (joined) {
+		if (expected) {
+			printf("%d clients joined in %.0f ms\n", expected, (uS::Latency::now() - connectStart) / 1e6);
+		}
+
+		// Spread the first sends of the clients over one interval
+		Interval = 1000000000LL / Config.rate;
+		ScheduleStart = uS::Latency::now();
+		MeasureStart = ScheduleStart + Config.warmup * 1000000000LL;
+		MeasureEnd = MeasureStart + Config.duration * 1000000000LL;
+		for (BenchThread* thread : threads) {
+			for (Client* c : thread->senders) {
+				c->next = ScheduleStart + Interval * c->global / Config.clients;
+			}
+		}
+		CurrentPhase.store(PhaseRunning, std::memory_order_release);
+		std::this_thread::sleep_for(std::chrono::nanoseconds(MeasureEnd - uS::Latency::now()) + std::chrono::milliseconds(DRAIN_MS));
+	}
+	else {
+		printf("Only %d of %d clients joined (%d failed to connect)\n", Joined.load(), expected, Failed.load());
+	}
+
+	CurrentPhase.store(PhaseStopping, std::memory_order_release);
+	for (std::thread* handle : handles) {
+		handle->join();
+	}
+	if (!joined) {
+		return 1;
+	}
+	Report(threads);
+	return 0;
+}
@@ -0,0 +1,331 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <uWS.h>
+
+/*
+		Zero-Copy Loopback Benchmark
+	> Broadcasts large frames from a server Hub to the clients of a second
+	Hub over 127.0.0.1, once with copying sends and once with MSG_ZEROCOPY
+	(Group::setZeroCopy), and reports the throughput of both.  Each run is
+	checked against the ZeroCopyStats of the server: the copying run sends
+	nothing zero-copy, the zero-copy run accounts for every frame byte.
+	Loopback copies zero-copy sends when it delivers them, so the kernel has
+	to report every byte as copied (SO_EE_CODE_ZEROCOPY_COPIED).
+
+	A last client completes its handshake and then stops reading, with a
+	tiny receive buffer.  Its socket is closed while the kernel still holds
+	zero-copy frames: they have to complete after the reset and every frame
+	has to be freed, none abandoned.
+
+	Compares the send paths of one machine, not a network: a NIC with
+	scatter-gather is where the zero-copy run actually saves the copy.
+*/
+#define PORT          3002
+#define CLIENTS       8
+#define FRAME_SIZE    (256 * 1024)       // Payload bytes, the frame adds a 10 byte header
+#define FRAMES        1000               // Per client and run
+#define WINDOW        (4 * FRAME_SIZE)   // Bytes queued on a socket before the server waits for it
+#define STALL_FRAMES  64                 // Frames queued for the client that stopped reading
+#define STALL_RCVBUF  4096               // Receive buffer of that client
+#define TICK_MS       1
+#define SETTLE_MS     200                // Completions still in the error queue are read meanwhile
+#define REAP_MS       2000               // Most time the reset connection may take to release its frames
+
+enum Phase {
+	PhaseConnecting,  // Clients connect, nothing is sent
+	PhaseRunning,     // The server broadcasts the frames of Runs[Run]
+	PhaseStalling,    // The client that stopped reading connects and gets frames queued
+	PhaseDone         // Every socket closes and the loops run out
+};
+std::atomic<int> CurrentPhase{PhaseConnecting};
+std::atomic<bool> Listening{false};
+std::atomic<int> Received{0};    // Frames the clients received this run
+std::atomic<int> Prepared{0};    // PreparedMessages built
+std::atomic<int> Destroyed{0};   // PreparedMessages freed after their last reference
+std::atomic<int> Failures{0};
+
+const size_t Runs[] = { 0, 1 };  // Zero-copy threshold of each run, 0 copies
+const char* RunNames[] = { "copy", "zerocopy" };
+
+/////////////////////
+// FRAMES
+/////////////////
+void (*DestroyPrepared)(uS::SharedPayload*);
+
+// A frame whose destruction is counted, the last queued message or orphaned send referencing it frees it
+uWS::WebSocket<uWS::SERVER>::PreparedMessage* PrepareFrame() {
+	static std::vector<char> payload(FRAME_SIZE, 'z');
+	uWS::WebSocket<uWS::SERVER>::PreparedMessage* frame = uWS::WebSocket<uWS::SERVER>::prepareMessage(payload.data(), payload.size(), uWS::OpCode::BINARY, false);
+	DestroyPrepared = frame->destroy;
+	frame->destroy = [](uS::SharedPayload* payload) {
+		Destroyed++;
+		DestroyPrepared(payload);
+	};
+	Prepared++;
+	return frame;
+}
+
+void Check(bool passed, const char* what) {
+	if (!passed) {
+		printf("FAILED: %s\n", what);
+		Failures++;
+	}
+}
+
+
+/////////////////////
+// SERVER
+/////////////////
+struct Server {
+	uWS::Hub* hub;
+	uS::Timer* ticker;
+	std::vector<uWS::WebSocket<uWS::SERVER>*> clients;
+	std::vector<int> sent;
+	uWS::WebSocket<uWS::SERVER>* stalled = nullptr;
+	uWS::WebSocket<uWS::SERVER>::PreparedMessage* frame = nullptr;
+	int run = 0;
+	int64_t start = 0;     // Steady clock (ns) when the phase began
+	int64_t finished = 0;  // When the clients had every frame, or the stalled socket was closed
+	uS::ZeroCopyStats before;
+};
+
+void StartRun(Server* server, int run) {
+	server->run = run;
+	server->hub->getDefaultGroup<uWS::SERVER>().setZeroCopy(Runs[run]);
+	server->frame = PrepareFrame();
+	server->sent.assign(CLIENTS, 0);
+	server->before = *server->hub->getZeroCopyStats();
+	server->start = uS::Latency::now();
+	server->finished = 0;
+	Received = 0;
+	CurrentPhase = PhaseRunning;
+}
+
+// Checks a run once its completions settled, then starts the next one or stalls
+void FinishRun(Server* server) {
+	uS::ZeroCopyStats &stats = *server->hub->getZeroCopyStats();
+	uint64_t zeroCopied = stats.zeroCopiedBytes - server->before.zeroCopiedBytes;
+	uint64_t copied = stats.copiedBytes - server->before.copiedBytes;
+	uint64_t bytes = (uint64_t)CLIENTS * FRAMES * server->frame->length;
+	double seconds = (server->finished - server->start) / 1e9;
+	printf("%-9s %8.2f GB/s  zero-copied %llu B, copied %llu B\n", RunNames[server->run], bytes / seconds / 1e9, (unsigned long long)zeroCopied, (unsigned long long)copied);
+
+	uWS::WebSocket<uWS::SERVER>::finalizeMessage(server->frame);
+	if (!Runs[server->run]) {
+		Check(!zeroCopied && !copied, "the copying run sent with MSG_ZEROCOPY");
+	}
+	else {
+		Check(zeroCopied + copied == bytes, "zero-copy completions do not account for every frame byte");
+		Check(!zeroCopied, "loopback reported zero-copy sends as not copied");
+	}
+
+	if (server->run + 1 < (int)(sizeof(Runs) / sizeof(Runs[0]))) {
+		StartRun(server, server->run + 1);
+		return;
+	}
+	server->hub->getDefaultGroup<uWS::SERVER>().setZeroCopy(1);
+	server->frame = PrepareFrame();
+	server->start = uS::Latency::now();
+	server->finished = 0;
+	CurrentPhase = PhaseStalling;
+}
+
+// Queues frames for the client that stopped reading, closes it and waits for its frames to be freed
+void Stall(Server* server, int64_t now) {
+	if (!server->stalled) {
+		return;
+	}
+	if (!server->finished) {
+		if (server->frame) {
+			for (int i = 0; i < STALL_FRAMES; i++) {
+				server->stalled->sendPrepared(server->frame);
+			}
+			uWS::WebSocket<uWS::SERVER>::finalizeMessage(server->frame);
+			server->frame = nullptr;
+			server->start = now;
+			return;
+		}
+		if (now - server->start < SETTLE_MS * 1000000LL) {
+			return;
+		}
+		server->before = *server->hub->getZeroCopyStats();
+		server->stalled->terminate();
+		server->finished = now;
+		return;
+	}
+
+	uS::ZeroCopyStats &stats = *server->hub->getZeroCopyStats();
+	if (Destroyed != Prepared && !stats.abandonedBytes && now - server->finished < REAP_MS * 1000000LL) {
+		return;
+	}
+	uint64_t completed = stats.zeroCopiedBytes + stats.copiedBytes - server->before.zeroCopiedBytes - server->before.copiedBytes;
+	printf("%-9s %llu B pending at close completed in %.1f ms, %llu B abandoned\n", "stall", (unsigned long long)completed, (now - server->finished) / 1e6, (unsigned long long)stats.abandonedBytes);
+	Check(completed > 0, "no zero-copy send was pending when the stalled socket closed");
+	Check(!stats.abandonedBytes, "the kernel never released frames of the reset connection");
+	Check(Destroyed == Prepared, "frames were not freed after their sends completed");
+
+	CurrentPhase = PhaseDone;
+	server->ticker->close();
+	server->hub->getDefaultGroup<uWS::SERVER>().close();
+}
+
+void RunServer() {
+	uWS::Hub h;
+	Server server;
+	server.hub = &h;
+
+	h.onConnection([&server](uWS::WebSocket<uWS::SERVER>* ws, uWS::HttpRequest req) {
+		uWS::Header url = req.getUrl();
+		if (url.valueLength == 6 && !memcmp(url.value, "/stall", 6)) {
+			server.stalled = ws;
+		}
+		else {
+			server.clients.push_back(ws);
+		}
+	});
+
+	server.ticker = new uS::Timer(h.getLoop());
+	server.ticker->setData(&server);
+	server.ticker->start([](uS::Timer* timer) {
+		Server* server = (Server*)timer->getData();
+		int64_t now = uS::Latency::now();
+		switch (CurrentPhase.load()) {
+			case PhaseConnecting: {
+				if (server->clients.size() == CLIENTS) {
+					StartRun(server, 0);
+				}
+				break;
+			}
+			case PhaseRunning: {
+				if (server->finished) {
+					if (now - server->finished >= SETTLE_MS * 1000000LL) {
+						FinishRun(server);
+					}
+					break;
+				}
+				if (Received == CLIENTS * FRAMES) {
+					server->finished = now;
+					break;
+				}
+				for (int i = 0; i < CLIENTS; i++) {
+					uWS::WebSocket<uWS::SERVER>* ws = server->clients[i];
+					while (server->sent[i] < FRAMES && ws->getBufferedAmount() < WINDOW) {
+						ws->sendPrepared(server->frame);
+						server->sent[i]++;
+					}
+				}
+				break;
+			}
+			case PhaseStalling: {
+				Stall(server, now);
+				break;
+			}
+		}
+	}, TICK_MS, TICK_MS);
+
+	if (!h.listen("127.0.0.1", PORT)) {
+		printf("FAILED: cannot listen on port %d\n", PORT);
+		Failures++;
+		CurrentPhase = PhaseDone;
+		server.ticker->close();
+	}
+	Listening = true;
+	h.run();
+}
+
+
+/////////////////////
+// CLIENTS
+/////////////////
+void RunClients() {
+	uWS::Hub h;
+	h.onMessage([](uWS::WebSocket<uWS::CLIENT>* ws, char* message, size_t length, uWS::OpCode code) {
+		if (length == FRAME_SIZE) {
+			Received++;
+		}
+	});
+	h.onError([](void* user) {
+		printf("FAILED: a client could not connect\n");
+		Failures++;
+	});
+	for (int i = 0; i < CLIENTS; i++) {
+		h.connect("ws://127.0.0.1:" + std::to_string(PORT));
+	}
+	h.run();
+}
+
+// Connects, upgrades and then never reads again
+int ConnectStalled() {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int rcvbuf = STALL_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_port = htons(PORT);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (sockaddr*)&address, sizeof(address))) {
+		close(fd);
+		return -1;
+	}
+
+	const char request[] = "GET /stall HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+	send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+
+	// Only the response, frames may follow it in the same read
+	char response[1024];
+	std::string head;
+	while (head.find("\r\n\r\n") == std::string::npos) {
+		ssize_t length = recv(fd, response, sizeof(response), 0);
+		if (length <= 0) {
+			close(fd);
+			return -1;
+		}
+		head.append(response, length);
+	}
+	return fd;
+}
+
+int main() {
+	std::thread server(RunServer);
+	while (!Listening) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	std::thread clients;
+	if (CurrentPhase != PhaseDone) {
+		clients = std::thread(RunClients);
+	}
+
+	int stalled = -1;
+	while (CurrentPhase != PhaseDone) {
+		if (CurrentPhase == PhaseStalling && stalled == -1) {
+			stalled = ConnectStalled();
+			if (stalled == -1) {
+				printf("FAILED: the stalled client could not connect\n");
+				exit(1);
+			}
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	server.join();
+	if (clients.joinable()) {
+		clients.join();
+	}
+	if (stalled != -1) {
+		close(stalled);
+	}
+	return Failures ? 1 : 0;
+}
@@ -1,15 +1,23 @@
 #include <stdint.h>
 #include <vector>
+#include <algorithm>
 #include <thread>
 #include <chrono>
 #include <uWS.h>
 #include <ctime>
+#include <cmath>
 #include <atomic>
 #include <immintrin.h>
+#include <deque>
+#include <random>
+#include <string>
+#include <unordered_map>
 #include "tbb/tbb.h"
 #include "tbb/concurrent_unordered_map.h"
-#include "tbb/concurrent_queue.h"
-#include "tbb/concurrent_unordered_set.h"
+#include "tbb/concurrent_hash_map.h"
+#include "tbb/spin_mutex.h"
+#include "tbb/spin_rw_mutex.h"
+#include "base64.h"
 
 //
 // SERVER CONFIGURATION SETTINGS
@@ -18,22 +26,79 @@
 #define SERVER_TLS_CERTIFICATE "/etc/letsencrypt/live/gl.ax/cert.pem"
 #define SERVER_TLS_PRIVATEKEY  "/etc/letsencrypt/live/gl.ax/privkey.pem"
 #define SERVER_TLS_KEYPASSWORD ""
-
-
-// GARBAGE COLLECTION
-#define WAIT_FOR_GC() while (gc_State==-1) {continue;}
-#define WAIT_FOR_RELAY() while (gc_State>0) {continue;}
+#define SERVER_TLS_KERNEL      false  // Kernel TLS (Linux, OpenSSL 3) encrypts after the handshake, OpenSSL keeps doing it where unsupported
+#define SERVER_MAX_MESSAGE     (16 * 1024 * 1024)  // Largest WebSocket message, the connection is closed beyond it
+
+// EPOCH RECLAMATION
+#define RECLAIM_INTERVAL_MS 250  // Idle threads still free what they retired at least this often
+
+// AUTO PING (per socket timeouts on the timer wheel of the thread, nothing sweeps the sessions)
+#define AUTOPING_INTERVAL_MS 15000  // Clients silent for a whole interval after a ping are terminated, 0 disables
+
+// BACKPRESSURE (bytes queued on a WebSocket the client has not read yet)
+#define BACKPRESSURE_HIGH_WATERMARK (4 * 1024 * 1024)  // Client becomes a slow consumer
+#define BACKPRESSURE_LOW_WATERMARK  (1024 * 1024)      // Slow consumer recovered
+#define BACKPRESSURE_POLICY         SlowConsumerClose  // SlowConsumerClose, SlowConsumerDropNew or SlowConsumerDropOldest
+
+// MESSAGE POOL (uS::MemoryPool, free lists of the memory messages are queued in, per Hub thread)
+#define POOL_SMALL_DEPTH  4096                // Blocks kept per class up to 1 KiB, fan-out queues a header per member
+#define POOL_LARGE_DEPTH  64                  // Blocks kept per class from 2 KiB to 64 KiB
+#define POOL_RETAIN_LIMIT (16 * 1024 * 1024)  // Bytes a thread keeps at most
+
+// ZERO COPY (MSG_ZEROCOPY on Linux, plaintext sockets only. Pinning pages costs more than copying small frames)
+#define ZEROCOPY_THRESHOLD 0  // Broadcast frames of at least this many bytes are sent without copying them to the socket, 0 disables
+
+// METRICS (Prometheus text format, served by the first Hub thread)
+#define METRICS_HOST "127.0.0.1"  // Keep the admin interface off public addresses
+#define METRICS_PORT 9464         // 0 disables the metrics listener
+#define METRICS_PATH "/metrics"
+#define METRICS_SAMPLE_MS 1000   // Gauges are sampled by their thread this often
+
+// LATENCY HISTOGRAMS (uS::Latency, per stage quantiles in the metrics)
+#define LATENCY_AT_STARTUP   false               // Recording costs two clock reads per stage, toggle it at runtime with:
+#define LATENCY_ENABLE_PATH  "/latency/enable"   // GET on the metrics listener
+#define LATENCY_DISABLE_PATH "/latency/disable"
+
+// RATE LIMITS (per session, messages and bytes per second)
+#define RATE_BROADCAST_MESSAGES 120
+#define RATE_BROADCAST_BYTES    (1024 * 1024)
+#define RATE_PRIVATE_MESSAGES   240
+#define RATE_PRIVATE_BYTES      (1024 * 1024)
+#define RATE_RELAY_OPS          60
+#define RATE_RELAY_BYTES        (256 * 1024)
+#define RATE_BURST_MS           1000  // Sessions may run this far ahead of their rates, a larger single message is let into a full budget
+#define RATE_AUTHENTICATED      16    // Rates of sessions with authLevel >= 1 are multiplied by this
 
 // WEBSOCKET EXIT CODES (and Messages)
-#define CLOSE_PROTOCOL_ERROR  1002
-#define CLOSE_UNSUPPORTED     1003
-#define CLOSE_TRY_AGAIN_LATER 1013
-#define CLOSE_USERID_TAKEN    4001  // Custom
+#define CLOSE_PROTOCOL_ERROR   1002
+#define CLOSE_UNSUPPORTED      1003
+#define CLOSE_POLICY_VIOLATION 1008
+#define CLOSE_TRY_AGAIN_LATER  1013
+#define CLOSE_USERID_TAKEN     4001  // Custom
 
 #define MSG_PROTOCOL_VIOLATION      "Protocol Violation"
 #define MSG_TYPE_UNSUPPORTED        "Type Unsupported"
 #define MSG_CHANNEL_LENGTH_EXCEEDED "Channel Length Exceeded"
 #define MSG_USERID_TAKEN            "UserID Taken"
+#define MSG_SLOW_CONSUMER           "Slow Consumer"
+#define MSG_RATE_LIMIT_EXCEEDED     "Rate Limit Exceeded"
+
+// RELAY THREADS
+#define MAX_RELAY_THREADS 256
+
+// CHANNELS
+#define CHANNEL_NAME_LENGTH 16          // Longest channel name a client may join
+#define NO_CHANNEL          0xFFFFFFFF  // Session::channelId before joining
+
+// CHANNEL VARIABLES
+#define VARIABLE_HEADER_LENGTH 9            // RE_RELAY_TARGET + reply opcode stored in front of every value
+#define VARIABLE_COMPACT_MIN   (64 * 1024)  // Arena garbage tolerated before compacting
+#define MAX_VARIABLE_WATCHES   32           // Watches a session may hold (relay op 11)
+
+// USERID LAYOUT (generated UserIDs, relay op 3 may assign any other value)
+#define USERID_SLOT_BITS   24  // Bits 0-23:  slot in the owner's SessionSlots
+#define USERID_THREAD_BITS 8   // Bits 24-31: RelayThread::index of the owner
+#define USERID_GEN_BITS    16  // Bits 32-47: slot generation, bits 48-63: random salt
 
 // FIXED USERID TARGETS
 #define RE_BROADCAST_TARGET 0xFFFFFFFFFFFFFFFF  // Broadcasts to everybody in the channel
@@ -59,101 +124,40 @@
 // GLOBALS
 /////////////////
 struct Session;
-std::atomic<char> gc_State; // garbage collector state
+struct VariableChange;
+struct Channel;
+struct ChannelMembers;
+struct RelayThread;
 
-// LOOKUP TABLES
-tbb::concurrent_unordered_map<uint64_t, Session*>                                   UserIDSessionMap;    //  Relay UserID  :  Session Pointer               (This was added to avoid using memory addresses as UserIDs) (Now UserID can be anything)
-tbb::concurrent_unordered_set<Session*>                                             SessionExists;       //       Session  :  Is Session Pointer Valid?     (Used to confirm Point-To-Point message recepient validity)
-tbb::concurrent_unordered_map<std::string, tbb::concurrent_unordered_set<Session*>> ChannelClientTable;  //  Channel Name  :  List of Subscribed Clients
-tbb::concurrent_unordered_set<Session*>* reGlobalChannelIndex;
+// RELAY THREADS
+RelayThread* RelayThreads[MAX_RELAY_THREADS]; // Every Hub thread, indexed by RelayThread::index
+int RelayThreadCount;
+thread_local RelayThread* LocalThread;         // RelayThread of the calling Hub thread
 
-// CHANNEL VARIABLE TABLE
-tbb::concurrent_unordered_map<std::string, tbb::concurrent_unordered_map<std::string, std::string>> ChannelVariables;
+// EPOCH RECLAMATION
+std::atomic<uint64_t> GlobalEpoch(1); // Advanced once every online Hub thread has observed it
 
-// GARBAGE COLLECTION QUEUE
-tbb::concurrent_queue<Session*> GarbageQueue;
+// LOOKUP TABLES
+tbb::concurrent_hash_map<uint64_t, Session*>         CustomUserIDs;       //  Relay op 3 UserID  :  Session Pointer          (Generated UserIDs are resolved through the slots they encode)
+Channel* reGlobalChannel;
 
 
 /////////////////////
 // Auxiliary Functions
 /////////////////
 
-// 2^128-1 period
+// 2^128-1 period, one generator per thread
 uint64_t rand64p() {
-	static uint64_t a=1337, b=1338;
-	static int init = 1;
+	thread_local uint64_t a = 0, b = 0;
+	if (!a && !b) {
+		std::random_device seed;
+		a = ((uint64_t)seed() << 32) | seed();
+		b = ((uint64_t)seed() << 32) | seed() | 1;
+	}
 	uint64_t x = a; a = b;
 	return a + (b = (x ^= x << 23) ^ b ^ (x >> 17) ^ (b >> 26));
 }
 
-int enc64(const char* input, int len, char* output) {
-	static const char b64[] =
-		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-	int i;
-
-	if (len == 0) {
-		return 0;
-	}
-	char q, *p = (char*)output;
-	if (len == 1) {
-		i = 0;
-		*p++ = b64[(input[i] >> 2) & 0x3F];
-		q = (input[i++] & 0x03) << 4;
-		*p++ = b64[q | ((input[i] & 0xF0) >> 4)];
-		*p++ = '=';
-		*p++ = '=';
-	}
-	else {
-		for (i = 0; i < len - 2; i++) {
-			*p++ = b64[(input[i] >> 2) & 0x3F];
-			q = (input[i++] & 0x03) << 4;
-			*p++ = b64[q | ((input[i] & 0xF0) >> 4)];
-			q = (input[i++] & 0x0F) << 2;
-			*p++ = b64[q | ((input[i] & 0xC0) >> 6)];
-			*p++ = b64[input[i] & 0x3F];
-		}
-		if (i < len) {
-			*p++ = b64[(input[i] >> 2) & 0x3F];
-			if (i == (len - 1)) {
-				*p++ = b64[((input[i] & 0x3) << 4)];
-				*p++ = '=';
-			}
-			else {
-				q = (input[i++] & 0x3) << 4;
-				*p++ = b64[q | ((input[i] & 0xF0) >> 4)];
-				*p++ = b64[((input[i] & 0xF) << 2)];
-			}
-			*p++ = '=';
-		}
-	}
-	return p - output;
-}
-
-static int dec64(const char* in, int len, unsigned char* out) {
-	const static int T[] = {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,
-		63,52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,-1,0,1,2,3,4,5,6,7,8,9,10,11,
-		12,13,14,15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,-1,26,27,28,29,30,31,32,
-		33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,-1,-1,-1,
-		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
-		-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
-	int index = 0;
-	int val = 0, valb = -8;
-	for (int i = 0; i<len; i++) {
-		if (T[in[i]] == -1) break;
-		val = (val << 6) + T[in[i]];
-		valb += 6;
-		if (valb >= 0) {
-			out[index++] = (val >> valb) & 0xFF;
-			valb -= 8;
-		}
-	}
-	return index;
-}
-
 
 /////////////////////
 // Structures
@@ -166,6 +170,7 @@ enum {
 	PrivateMessage    = 0b0010,
 	DisconnectMessage = 0b0100
 };
+#define LISTENER_KINDS 3  // Bits of the Message Mode Masks, one ListenerList each
 
 struct RelayAuth {
 	const char* password;
@@ -176,6 +181,662 @@ RelayAuth Credentials[] = {
 	{ "metalgear", 1 }
 };
 
+/*
+		Flood Protection
+	> Every session has a message and a byte budget per kind of traffic,
+	kept as GCRA token buckets: a bucket is the time at which it would be
+	empty again, and a message of cost c is admitted if that time does not
+	run more than RATE_BURST_MS ahead of now after adding c.  Costs are
+	precomputed in nanoseconds per unit, so checking a message takes a few
+	multiplications and no clock call; now is read once per loop wakeup.
+
+	A message may cost more bytes than the whole burst, up to
+	SERVER_MAX_MESSAGE.  It is admitted once its bucket is full and charged
+	in full, the session then stays quiet until it paid the debt off.
+
+	Sessions exceeding a budget are closed with CLOSE_POLICY_VIOLATION.
+*/
+enum RateClass {
+	RateBroadcast,
+	RatePrivate,
+	RateRelay,
+	RATE_CLASSES
+};
+
+struct RateLimit {
+	int64_t messageCost;  // Nanoseconds per message
+	int64_t byteCost;     // Nanoseconds per byte
+	int64_t burst;        // Nanoseconds a bucket may run ahead of now
+
+	RateLimit(int64_t messages, int64_t bytes, int64_t factor) {
+		messageCost = 1000000000 / (messages * factor);
+		byteCost    = 1000000000 / (bytes * factor);
+		burst       = (int64_t)RATE_BURST_MS * 1000000;
+	}
+};
+
+// By tier (0 = anonymous, 1 = authLevel >= 1), then RateClass
+const RateLimit RateLimits[2][RATE_CLASSES] = {
+	{
+		{ RATE_BROADCAST_MESSAGES, RATE_BROADCAST_BYTES, 1 },
+		{ RATE_PRIVATE_MESSAGES,   RATE_PRIVATE_BYTES,   1 },
+		{ RATE_RELAY_OPS,          RATE_RELAY_BYTES,     1 }
+	},
+	{
+		{ RATE_BROADCAST_MESSAGES, RATE_BROADCAST_BYTES, RATE_AUTHENTICATED },
+		{ RATE_PRIVATE_MESSAGES,   RATE_PRIVATE_BYTES,   RATE_AUTHENTICATED },
+		{ RATE_RELAY_OPS,          RATE_RELAY_BYTES,     RATE_AUTHENTICATED }
+	}
+};
+
+struct TokenBucket {
+	int64_t messagesEmpty = 0;  // Loop time (ns) at which the message budget is full again
+	int64_t bytesEmpty    = 0;  // Same for the byte budget
+
+	// Takes one message of length bytes out of the bucket, false if that exceeds limit.
+	// Byte costs above the burst are checked as the burst, so they only pass a full bucket
+	bool take(const RateLimit &limit, int64_t now, size_t length) {
+		int64_t messages  = std::max(messagesEmpty, now) + limit.messageCost;
+		int64_t byteCost  = limit.byteCost * (int64_t)length;
+		int64_t bytesFrom = std::max(bytesEmpty, now);
+		if (messages - now > limit.burst || bytesFrom + std::min(byteCost, limit.burst) - now > limit.burst) {
+			return false;
+		}
+		int64_t bytes = bytesFrom + byteCost;
+		messagesEmpty = messages;
+		bytesEmpty    = bytes;
+		return true;
+	}
+};
+
+/*
+		Cross-Thread Deliveries
+	> A socket may only be written by the loop that owns it.  Messages for
+	sessions of another Hub thread are copied into a Delivery, collected in
+	the sender's per-destination Outbox and handed to the owner's Mailbox
+	in one batch at the end of the sender's loop iteration.
+
+	The Mailbox is a lock-free multi-producer single-consumer stack. Batches
+	are linked newest-first, so reversing the drained stack restores the
+	order in which each producer posted them.
+*/
+typedef uWS::WebSocket<uWS::SERVER>::PreparedMessage PreparedMessage;
+
+enum DeliveryKind : uint8_t {
+	DeliverMessage,  // Send data[0..length) to the target
+	DeliverClose,    // Close the target with closeCode and reason data[0..length)
+	DeliverPrepared, // Send prepared to the length DeliveryTargets in data
+	DeliverMembers,  // Send prepared to members[destination] (of a channel or listener list)
+	DeliverEverybody // Send prepared to every session of the destination
+};
+
+struct DeliveryTarget {
+	uint32_t slot;
+	uint32_t generation;
+};
+
+struct Delivery {
+	Delivery*        next;
+	uint32_t         slot;        // Target slot in the owner's SessionSlots
+	uint32_t         generation;  // Target generation, stale deliveries are dropped
+	uint8_t          kind;
+	uWS::OpCode      opCode;
+	uint16_t         closeCode;
+	PreparedMessage* prepared;    // DeliverPrepared, DeliverMembers and DeliverEverybody, holds one reference
+	ChannelMembers*  members;     // DeliverMembers only, one per Hub thread
+	Channel*         channel;     // DeliverMembers of a channel, counted in channel->inFlight
+	uWS::WebSocket<uWS::SERVER>* except; // DeliverMembers and DeliverEverybody session left out
+	size_t           length;
+	char             data[1];
+};
+
+Delivery* AllocDelivery(size_t length) {
+	return (Delivery*)malloc(offsetof(Delivery, data) + length);
+}
+
+struct Outbox {
+	Delivery* head = nullptr; // newest
+	Delivery* tail = nullptr; // oldest
+
+	void push(Delivery* delivery) {
+		delivery->next = head;
+		head = delivery;
+		if (!tail) {
+			tail = delivery;
+		}
+	}
+};
+
+struct Mailbox {
+	std::atomic<Delivery*> head{nullptr};
+
+	// Returns true if the mailbox was empty, meaning the owner must be woken up
+	bool push(Delivery* newest, Delivery* oldest) {
+		Delivery* expected = head.load(std::memory_order_relaxed);
+		do {
+			oldest->next = expected;
+		} while (!head.compare_exchange_weak(expected, newest, std::memory_order_release, std::memory_order_relaxed));
+		return expected == nullptr;
+	}
+
+	// Takes every pending delivery, oldest first
+	Delivery* drain() {
+		Delivery* list = head.exchange(nullptr, std::memory_order_acquire);
+		Delivery* ordered = nullptr;
+		while (list) {
+			Delivery* next = list->next;
+			list->next = ordered;
+			ordered = list;
+			list = next;
+		}
+		return ordered;
+	}
+};
+
+/*
+		Session Slots
+	> Sessions owned by a Hub thread, addressed by {slot, generation} so a
+	Delivery never holds a pointer to a Session that may be collected before
+	the Delivery is drained.
+
+	Only the owning thread adds and removes sessions.  Slots live in chunks
+	that never move, so any thread may look up the slot a generated UserID
+	encodes, and walking them stays valid while sessions come and go.
+*/
+struct SessionSlots {
+	static const uint32_t CHUNK_SIZE = 4096;
+	static const uint32_t MAX_CHUNKS = 4096; // 16M sessions per thread
+
+	struct Slot {
+		std::atomic<Session*> session;
+		std::atomic<uint32_t> generation;
+	};
+
+	std::atomic<Slot*>    chunks[MAX_CHUNKS] = {};
+	std::atomic<uint32_t> size{0};       // Slots handed out so far, readers never look past it
+	std::atomic<uint32_t> population{0}; // Sessions currently held, for other threads
+	std::vector<uint32_t> freeSlots;     // Owner only
+
+	Slot &at(uint32_t slot) {
+		return chunks[slot / CHUNK_SIZE].load(std::memory_order_acquire)[slot % CHUNK_SIZE];
+	}
+
+	uint32_t add(Session* session) {
+		uint32_t slot;
+		if (freeSlots.size()) {
+			slot = freeSlots.back();
+			freeSlots.pop_back();
+		}
+		else {
+			slot = size.load(std::memory_order_relaxed);
+			if (slot % CHUNK_SIZE == 0) {
+				chunks[slot / CHUNK_SIZE].store(new Slot[CHUNK_SIZE](), std::memory_order_release);
+			}
+			size.store(slot + 1, std::memory_order_release);
+		}
+		at(slot).session.store(session, std::memory_order_release);
+		population.store(population.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return slot;
+	}
+
+	void remove(uint32_t slot) {
+		Slot &entry = at(slot);
+		entry.session.store(nullptr, std::memory_order_relaxed);
+		entry.generation.store(entry.generation.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		population.store(population.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		freeSlots.push_back(slot);
+	}
+
+	Session* get(uint32_t slot) {
+		if (slot >= size.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return at(slot).session.load(std::memory_order_acquire);
+	}
+
+	Session* resolve(uint32_t slot, uint32_t generation) {
+		if (slot >= size.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		Slot &entry = at(slot);
+		Session* session = entry.session.load(std::memory_order_acquire);
+		if (entry.generation.load(std::memory_order_acquire) != generation) {
+			return nullptr;
+		}
+		return session;
+	}
+
+	template <class F>
+	void forEach(const F &cb) {
+		uint32_t count = size.load(std::memory_order_acquire);
+		for (uint32_t slot = 0; slot < count; slot++) {
+			Session* session = at(slot).session.load(std::memory_order_acquire);
+			if (session) {
+				cb(session);
+			}
+		}
+	}
+};
+
+// Objects waiting for every Hub thread to pass a quiescent state (see EPOCH RECLAMATION)
+struct Retired {
+	uint64_t epoch;
+	void (*destroy)(void*);
+	void* object;
+};
+
+/*
+		Metrics
+	> Every Hub thread counts into its own RelayCounters, aligned to cache
+	lines of their own so the counting threads never share one.  Only the
+	owning thread writes them (relaxed load and store, no locked
+	instructions); the metrics listener and relay op 6 sum every thread's
+	copy when asked.  Gauges that would cost a write per message, such as
+	queued bytes, are sampled by their thread every METRICS_SAMPLE_MS, as
+	are the plain counters uWS keeps in the thread's uS::MemoryPool.
+
+	Stage latencies (read, parse, handler, fan-out, socket queue) go to
+	the per-thread uS::Latency histograms while enabled.  Those are
+	merged on scrape and reported as p50, p99 and p999 per stage.
+*/
+struct alignas(64) RelayCounters {
+	std::atomic<uint64_t> connections{0};     // WebSocket upgrades
+	std::atomic<uint64_t> disconnections{0};
+	std::atomic<uint64_t> joins{0};           // Sessions that joined a channel
+	std::atomic<uint64_t> tlsHandshakes{0};
+	std::atomic<uint64_t> tlsKernelSend{0};   // Handshakes after which kernel TLS took over, by direction
+	std::atomic<uint64_t> tlsKernelReceive{0};
+
+	std::atomic<uint64_t> textIn{0};          // Messages received, by type
+	std::atomic<uint64_t> binaryIn{0};
+	std::atomic<uint64_t> textBytesIn{0};
+	std::atomic<uint64_t> binaryBytesIn{0};
+	std::atomic<uint64_t> textOut{0};         // Relayed messages sent (broadcast fan-out and private messages), by type
+	std::atomic<uint64_t> binaryOut{0};
+	std::atomic<uint64_t> textBytesOut{0};
+	std::atomic<uint64_t> binaryBytesOut{0};
+
+	std::atomic<uint64_t> broadcasts{0};      // Broadcasts sent by this thread
+	std::atomic<uint64_t> framesBuilt{0};     // WebSocket frames built for them
+	std::atomic<uint64_t> privateMisses{0};   // Private messages to a UserId without session
+	std::atomic<uint64_t> slowConsumers{0};   // Sessions that reached BACKPRESSURE_HIGH_WATERMARK
+	std::atomic<uint64_t> droppedMessages{0}; // Relayed messages dropped for slow consumers
+	std::atomic<uint64_t> rateLimited{0};     // Sessions closed for exceeding a RateLimit
+
+	std::atomic<uint64_t> sessions{0};        // Gauges, sampled
+	std::atomic<uint64_t> queuedBytes{0};     // Bytes queued on the sockets of sessions
+	std::atomic<uint64_t> retiredObjects{0};  // Retired objects not freed yet (epoch reclamation backlog)
+	std::atomic<uint64_t> poolHits{0};        // Message allocations served by the MemoryPool of the thread
+	std::atomic<uint64_t> poolMisses{0};      // Message allocations that went to the heap
+	std::atomic<uint64_t> poolRetainedBytes{0};
+	std::atomic<uint64_t> zeroCopiedBytes{0}; // Bytes of MSG_ZEROCOPY sends that completed without a copy
+	std::atomic<uint64_t> zeroCopyCopiedBytes{0}; // Bytes of MSG_ZEROCOPY sends that were copied after all
+	std::atomic<uint64_t> zeroCopyAbandonedBytes{0}; // Bytes of MSG_ZEROCOPY sends never reported done after their socket closed
+};
+
+inline void AddRelayCounter(std::atomic<uint64_t> &counter, uint64_t value) {
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+struct RelayThread {
+	int index;
+	uWS::Hub* hub = nullptr;
+	uS::Async* async = nullptr;  // Wakes the loop when the Mailbox goes from empty to non-empty
+	Mailbox mailbox;
+	SessionSlots slots;
+
+	Outbox outboxes[MAX_RELAY_THREADS]; // Deliveries waiting for the end of this loop iteration, by destination
+	std::vector<int> pendingOutboxes;   // Indices of non-empty outboxes
+
+	std::vector<DeliveryTarget> fanout[MAX_RELAY_THREADS]; // Remote recipients of the Broadcast being built, by owner
+	std::vector<int> fanoutThreads;                        // Indices of non-empty fanout lists
+
+	std::vector<VariableChange> changedVariables; // Watched variables written during this loop iteration
+
+	std::vector<Session*> slowConsumers; // Sessions to close at the end of this loop iteration (SlowConsumerClose)
+
+	int64_t loopTime = 0;  // Steady clock (ns) when the loop last woke up, see TokenBucket
+
+	RelayCounters counters;
+	uS::Timer* sampleTimer = nullptr;
+	uS::Latency latency;  // Stage histograms of this thread's sockets, see LATENCY_AT_STARTUP
+
+	alignas(64) std::atomic<uint64_t> epoch{0}; // GlobalEpoch observed when this loop woke up, 0 while offline
+	std::deque<Retired> retired;                // Oldest first
+	uS::Timer* reclaimTimer = nullptr;
+
+	RelayThread(int index) {
+		this->index = index;
+	}
+};
+
+// Sums counter over every Hub thread
+uint64_t SumRelayCounter(std::atomic<uint64_t> RelayCounters::* counter) {
+	uint64_t sum = 0;
+	for (int i = 0; i < RelayThreadCount; i++) {
+		sum += (RelayThreads[i]->counters.*counter).load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+/*
+		Relay Channel
+	> Every Hub thread keeps its own members of a channel in a dense array,
+	so a broadcast is a linear scan over WebSocket pointers.  Only the
+	owning thread reads or writes its array: other threads post one
+	DeliverMembers to it instead of touching its sockets.  Leaving swaps
+	the last member into the hole, using Session::memberIndex.
+
+	A channel is erased once it has no members and no DeliverMembers in
+	flight, whichever of the two drops to zero last.
+*/
+struct ChannelMember {
+	uWS::WebSocket<uWS::SERVER>* webSocket;
+};
+
+struct ChannelMembers {
+	std::vector<ChannelMember> list;  // Owning thread only
+	std::atomic<uint32_t> count{0};   // list.size() for other threads
+
+	uint32_t add(uWS::WebSocket<uWS::SERVER>* webSocket) {
+		list.push_back({ webSocket });
+		count.store((uint32_t)list.size(), std::memory_order_relaxed);
+		return (uint32_t)list.size() - 1;
+	}
+
+	// Returns the WebSocket moved into index, whose back-index must be updated
+	uWS::WebSocket<uWS::SERVER>* remove(uint32_t index) {
+		ChannelMember last = list.back();
+		list[index] = last;
+		list.pop_back();
+		count.store((uint32_t)list.size(), std::memory_order_relaxed);
+		return last.webSocket;
+	}
+};
+
+/*
+		Listener Lists
+	> 're_globl' members listening for a message mode (relay op 1) are kept
+	in one list per mode bit, laid out like channel members.  Messages only
+	look at the list of their mode, so without listeners it is one branch.
+*/
+struct ListenerList {
+	ChannelMembers* members;          // One per Hub thread, indexed by RelayThread::index
+	std::atomic<uint32_t> population; // Listeners on every thread
+};
+ListenerList Listeners[LISTENER_KINDS]; // Indexed by bit number of the Message Mode Mask
+
+/*
+		Channel Keys
+	> Channel names fit in 16 bytes, so they are kept zero padded in one SSE
+	register worth of bytes and compared with a single instruction.  The
+	hash is computed once, when the key is built from the joining packet.
+*/
+struct ChannelKey {
+	char bytes[CHANNEL_NAME_LENGTH];
+	uint32_t length;
+	uint32_t hash;
+
+	ChannelKey() : length(0), hash(0) {
+		memset(bytes, 0, sizeof(bytes));
+	}
+
+	// NOTICE: length must not exceed CHANNEL_NAME_LENGTH
+	ChannelKey(const char* name, size_t length) {
+		memset(bytes, 0, sizeof(bytes));
+		memcpy(bytes, name, length);
+		this->length = (uint32_t)length;
+
+		uint64_t low, high;
+		memcpy(&low, bytes, 8);
+		memcpy(&high, bytes + 8, 8);
+		uint64_t h = (low * 0x9E3779B97F4A7C15ULL) ^ ((high ^ length) * 0xC2B2AE3D27D4EB4FULL);
+		this->hash = (uint32_t)(h ^ (h >> 32));
+	}
+
+	bool operator==(const ChannelKey &other) const {
+		__m128i a = _mm_loadu_si128((const __m128i*)bytes);
+		__m128i b = _mm_loadu_si128((const __m128i*)other.bytes);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF && length == other.length;
+	}
+};
+
+struct ChannelKeyHashCompare {
+	size_t hash(const ChannelKey &key) const {
+		return key.hash;
+	}
+	bool equal(const ChannelKey &a, const ChannelKey &b) const {
+		return a == b;
+	}
+};
+
+// Channel Name : Channel ID (Channels.get)
+tbb::concurrent_hash_map<ChannelKey, uint32_t, ChannelKeyHashCompare> ChannelDirectory;
+
+inline int64_t SteadyMilliseconds() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline int64_t SteadyNanoseconds() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+		Channel Variables
+	> Every value is stored in the channel's arena right behind the header
+	of its op 5 reply, so reading a variable is one send out of the arena
+	under a shared lock.  Writes stamp the key with a version taken from a
+	channel-wide counter, which compare-and-set (op 9) checks against.
+	Overwritten values are left behind as garbage until it outweighs the
+	live values, then the arena is compacted and expired keys are dropped.
+*/
+struct ChannelVariable {
+	uint32_t offset;   // Reply header in ChannelVariables::arena, the value follows it
+	uint32_t length;   // Value length
+	uint64_t version;  // Never 0, a missing key reads as version 0
+	int64_t expiry;    // SteadyMilliseconds() deadline, 0 = never
+};
+
+/*
+		Variable Watches
+	> A session may watch a key, or every key under a prefix, of its
+	channel (relay op 11).  Writes to a watched variable are noted by the
+	writing thread and pushed once per key at the end of its loop iteration,
+	with the value current at that point, so a burst of writes to one key
+	costs watchers one frame.
+*/
+struct VariableWatch {
+	Session* session;  // Removed before session is retired, see LeaveChannel
+	std::string key;
+	bool prefix;
+
+	bool matches(const std::string &changed) const {
+		if (prefix) {
+			return changed.size() >= key.size() && changed.compare(0, key.size(), key) == 0;
+		}
+		return changed == key;
+	}
+};
+
+struct VariableChange {
+	uint32_t channelId;
+	std::string key;
+
+	bool operator<(const VariableChange &other) const {
+		return channelId != other.channelId ? channelId < other.channelId : key < other.key;
+	}
+	bool operator==(const VariableChange &other) const {
+		return channelId == other.channelId && key == other.key;
+	}
+};
+
+struct ChannelVariables {
+	tbb::spin_rw_mutex lock;  // Shared to read, exclusive to write
+	std::unordered_map<std::string, ChannelVariable> table;
+	std::vector<char> arena;
+	size_t garbage = 0;       // Arena bytes no longer referenced by table
+	uint64_t clock = 0;       // Last version handed out
+	std::vector<VariableWatch> watches;
+
+	// NOTICE: Callers hold lock (shared is enough)
+	const ChannelVariable* find(const std::string &key, int64_t now) const {
+		auto node = table.find(key);
+		if (node == table.end() || (node->second.expiry && node->second.expiry <= now)) {
+			return nullptr;
+		}
+		return &node->second;
+	}
+
+	const char* reply(const ChannelVariable* variable) const {
+		return &arena[variable->offset];
+	}
+
+	// NOTICE: Callers hold lock exclusively, returns the new version
+	// Like a Redis SET, a write makes the key persistent again: a TTL from op 10 lasts until the next write
+	uint64_t set(const std::string &key, const char* value, uint32_t length) {
+		auto node = table.find(key);
+		if (node != table.end()) {
+			if (length <= node->second.length) {
+				// Readers are locked out, overwrite in place
+				memcpy(&arena[node->second.offset + VARIABLE_HEADER_LENGTH], value, length);
+				garbage += node->second.length - length;
+				node->second.length  = length;
+				node->second.version = ++clock;
+				node->second.expiry  = 0;
+				return node->second.version;
+			}
+			garbage += VARIABLE_HEADER_LENGTH + node->second.length;
+		}
+
+		if (garbage > VARIABLE_COMPACT_MIN && garbage > arena.size() / 2) {
+			// The old value is dead already, don't carry it over
+			if (node != table.end()) {
+				table.erase(node);
+				node = table.end();
+			}
+			compact(SteadyMilliseconds());
+		}
+		if (node == table.end()) {
+			node = table.emplace(key, ChannelVariable{0, 0, 0, 0}).first;
+		}
+		node->second.offset  = append(value, length);
+		node->second.length  = length;
+		node->second.version = ++clock;
+		node->second.expiry  = 0;
+		return node->second.version;
+	}
+
+	// NOTICE: Callers hold lock exclusively, ttl 0 keeps the key until it is overwritten
+	bool expire(const std::string &key, uint32_t ttl, int64_t now) {
+		auto node = table.find(key);
+		if (node == table.end() || (node->second.expiry && node->second.expiry <= now)) {
+			return false;
+		}
+		node->second.expiry = ttl ? now + ttl : 0;
+		return true;
+	}
+
+	void clear() {
+		table.clear();
+		watches.clear();
+		arena.clear();
+		if (arena.capacity() > VARIABLE_COMPACT_MIN) {
+			std::vector<char>().swap(arena);
+		}
+		garbage = 0;
+		clock = 0;
+	}
+
+private:
+	uint32_t append(const char* value, uint32_t length) {
+		uint32_t offset = (uint32_t)arena.size();
+		arena.resize(offset + VARIABLE_HEADER_LENGTH + length);
+		char* cur = &arena[offset];
+		*(uint64_t*)cur = RE_RELAY_TARGET; cur += 8;
+		*cur = (char)200; cur += 1;
+		memcpy(cur, value, length);
+		return offset;
+	}
+
+	void compact(int64_t now) {
+		std::vector<char> live;
+		live.swap(arena);
+		for (auto node = table.begin(); node != table.end();) {
+			if (node->second.expiry && node->second.expiry <= now) {
+				node = table.erase(node);
+				continue;
+			}
+			node->second.offset = append(&live[node->second.offset + VARIABLE_HEADER_LENGTH], node->second.length);
+			++node;
+		}
+		garbage = 0;
+	}
+};
+
+struct Channel {
+	uint32_t id;
+	ChannelKey key;
+	std::atomic<bool> listed;         // In ChannelDirectory, false while pooled
+	ChannelMembers* members;          // One per Hub thread, indexed by RelayThread::index
+	std::atomic<uint32_t> population; // Members on every thread
+	std::atomic<uint32_t> inFlight;   // DeliverMembers posted but not yet drained
+
+	ChannelVariables variables;
+
+	Channel() : id(0), listed(false), members(new ChannelMembers[RelayThreadCount]), population(0), inFlight(0) {}
+
+	// NOTICE: Must be called by session->owner
+	void add(Session* session);
+	void remove(Session* session);
+};
+
+/*
+		Channel Pool
+	> Channels are addressed by id and never freed.  An emptied channel is
+	taken out of ChannelDirectory and its id is recycled once every thread
+	passed a quiescent state, so a lobby that empties and refills reuses
+	the member arrays it already grew.
+*/
+struct ChannelPool {
+	static const uint32_t CHUNK_SIZE = 1024;
+	static const uint32_t MAX_CHUNKS = 4096; // 4M channels
+
+	std::atomic<Channel*> chunks[MAX_CHUNKS] = {};
+	std::atomic<uint32_t> size{0};  // Ids handed out so far, readers never look past it
+	tbb::spin_mutex freeLock;
+	std::vector<uint32_t> freeIds;  // Guarded by freeLock
+
+	Channel* get(uint32_t id) {
+		return &chunks[id / CHUNK_SIZE].load(std::memory_order_acquire)[id % CHUNK_SIZE];
+	}
+
+	Channel* acquire() {
+		tbb::spin_mutex::scoped_lock lock(freeLock);
+		if (freeIds.size()) {
+			Channel* channel = get(freeIds.back());
+			freeIds.pop_back();
+			channel->variables.clear();
+			return channel;
+		}
+		uint32_t id = size.load(std::memory_order_relaxed);
+		if (id % CHUNK_SIZE == 0) {
+			Channel* chunk = new Channel[CHUNK_SIZE];
+			for (uint32_t i = 0; i < CHUNK_SIZE; i++) {
+				chunk[i].id = id + i;
+			}
+			chunks[id / CHUNK_SIZE].store(chunk, std::memory_order_release);
+		}
+		size.store(id + 1, std::memory_order_release);
+		return get(id);
+	}
+
+	void release(Channel* channel) {
+		tbb::spin_mutex::scoped_lock lock(freeLock);
+		freeIds.push_back(channel->id);
+	}
+};
+ChannelPool Channels;
+
 /* 
 		Relay Session Information
 	> The goal is to be as lightweight as possible, only holding information
@@ -184,90 +845,623 @@ RelayAuth Credentials[] = {
 	Host Clients are special relay clients which have unique jobs
 	such as storing user information or negotiating matchmaking.
 
-	There is not a seperate protocol for a Host Client, and they may fill
-	various tasks depending on the needs of an application using the relay.
+	There is not a seperate protocol for a Host Client, and they may fill
+	various tasks depending on the needs of an application using the relay.
+*/
+struct Session {
+	uWS::WebSocket<uWS::SERVER>* webSocket;
+	std::time_t timeOfConnection;  // When connection occured (GMT+0)
+	uint64_t userId;
+
+	RelayThread* owner;   // Hub thread whose loop owns webSocket, the only thread allowed to write to it
+	uint32_t slot;        // Index in owner->slots
+	uint32_t generation;  // owner->slots generation at the time this session took the slot
+
+	uint32_t channelId;       // Channel the user is in (Channels.get), NO_CHANNEL until it joined
+	uint32_t memberIndex;     // Index in channel->members[owner->index].list
+	uint32_t listenerIndex[LISTENER_KINDS]; // Index in Listeners[bit].members[owner->index].list, for bits set in listenerMode
+	std::atomic<bool> valid;  // Is socket still valid (1 if ready, 0 if disconnected and pending deletion)
+	int listenerMode;
+	int authLevel;   // Level 1 = Relay Query & Listener Authentication
+	int watchCount;  // Entries in the channel's ChannelVariables::watches
+	bool slowConsumer; // Reached BACKPRESSURE_HIGH_WATERMARK at least once
+	TokenBucket buckets[RATE_CLASSES];
+
+	Session(uWS::WebSocket<uWS::SERVER>* ws, RelayThread* owner) {
+		// Setup Session
+		this->webSocket = ws;
+		this->timeOfConnection = std::time(nullptr);
+		this->valid        = true;
+		this->listenerMode = 0;
+		this->authLevel    = 0;
+		this->watchCount   = 0;
+		this->slowConsumer = false;
+		this->channelId    = NO_CHANNEL;
+
+		// Pin Session to the owning thread
+		this->owner      = owner;
+		this->slot       = owner->slots.add(this);
+		this->generation = owner->slots.at(this->slot).generation.load();
+
+		// Encode the slot in the userId, the salt keeps it unguessable
+		uint64_t handle = (uint64_t)this->slot
+			| ((uint64_t)owner->index << USERID_SLOT_BITS)
+			| ((uint64_t)(this->generation & ((1 << USERID_GEN_BITS) - 1)) << (USERID_SLOT_BITS + USERID_THREAD_BITS));
+		do {
+			this->userId = handle | (rand64p() << (USERID_SLOT_BITS + USERID_THREAD_BITS + USERID_GEN_BITS));
+		} while (this->userId == RE_RELAY_TARGET || this->userId == RE_BROADCAST_TARGET);
+
+		// Populate Lookup Tables
+		ws->setUserData(this);
+	}
+};
+
+void Channel::add(Session* session) {
+	session->memberIndex = members[session->owner->index].add(session->webSocket);
+	population++;
+}
+
+void Channel::remove(Session* session) {
+	uWS::WebSocket<uWS::SERVER>* moved = members[session->owner->index].remove(session->memberIndex);
+	((Session*)moved->getUserData())->memberIndex = session->memberIndex;
+	population--;
+}
+
+// Updates client->listenerMode and the listener lists of a 're_globl' member
+// NOTICE: Must be called by client->owner
+void SetListenerMode(Session* client, int listenerMode) {
+	if (client->channelId == reGlobalChannel->id) {
+		for (int i = 0; i < LISTENER_KINDS; i++) {
+			bool listening = (client->listenerMode >> i) & 1;
+			if (((listenerMode >> i) & 1) == listening) {
+				continue;
+			}
+			ChannelMembers &local = Listeners[i].members[client->owner->index];
+			if (listening) {
+				uWS::WebSocket<uWS::SERVER>* moved = local.remove(client->listenerIndex[i]);
+				((Session*)moved->getUserData())->listenerIndex[i] = client->listenerIndex[i];
+				Listeners[i].population--;
+			}
+			else {
+				client->listenerIndex[i] = local.add(client->webSocket);
+				Listeners[i].population++;
+			}
+		}
+	}
+	client->listenerMode = listenerMode;
+}
+
+// Returns the Session whose generated userId this is, or nullptr
+Session* FindGeneratedSession(uint64_t userId) {
+	uint32_t thread = (userId >> USERID_SLOT_BITS) & ((1 << USERID_THREAD_BITS) - 1);
+	if (thread >= (uint32_t)RelayThreadCount) {
+		return nullptr;
+	}
+	Session* session = RelayThreads[thread]->slots.get(userId & ((1 << USERID_SLOT_BITS) - 1));
+	if (session && session->userId == userId) {
+		return session;
+	}
+	return nullptr;
+}
+
+// Returns the Session owning userId, or nullptr
+Session* FindSession(uint64_t userId) {
+	if (!CustomUserIDs.empty()) {
+		tbb::concurrent_hash_map<uint64_t, Session*>::const_accessor node;
+		if (CustomUserIDs.find(node, userId)) {
+			return node->second;
+		}
+	}
+	return FindGeneratedSession(userId);
+}
+
+
+/////////////////////
+// EPOCH RECLAMATION
+/////////////////
+/*
+	> Hub threads come online in Loop::preCb and go offline in Loop::postCb,
+	so every loop iteration is a quiescent state: while blocked in epoll a
+	thread holds no Session or Channel pointers.
+
+	Objects are retired once they are unlinked from every shared structure,
+	tagged with the epoch of that moment.  The global epoch only advances
+	after every online thread observed it, so once it moved two steps ahead
+	no thread can still reach the object and the retiring thread frees it.
+*/
+void Retire(void* object, void (*destroy)(void*)) {
+	LocalThread->retired.push_back({ GlobalEpoch.load(), destroy, object });
+}
+
+template <class T>
+void Retire(T* object) {
+	Retire(object, [](void* p) { delete (T*)p; });
+}
+
+// Loop::preCb
+void EnterEpoch(RelayThread* self) {
+	self->epoch.store(GlobalEpoch.load());
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+bool TryAdvanceEpoch(uint64_t epoch) {
+	for (int i = 0; i < RelayThreadCount; i++) {
+		uint64_t observed = RelayThreads[i]->epoch.load();
+		if (observed && observed != epoch) {
+			return false;
+		}
+	}
+	return GlobalEpoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+// Loop::postCb
+void LeaveEpoch(RelayThread* self) {
+	if (self->retired.size()) {
+		uint64_t epoch = GlobalEpoch.load();
+		if (TryAdvanceEpoch(epoch)) {
+			epoch++;
+		}
+		while (self->retired.size() && self->retired.front().epoch + 2 <= epoch) {
+			Retired &garbage = self->retired.front();
+			garbage.destroy(garbage.object);
+			self->retired.pop_front();
+		}
+	}
+	self->epoch.store(0, std::memory_order_release);
+}
+
+
+/////////////////////
+// CHANNELS
+/////////////////
+void JoinChannel(Session* client, const ChannelKey &key) {
+	// The directory entry stays locked until client is counted in population
+	tbb::concurrent_hash_map<ChannelKey, uint32_t, ChannelKeyHashCompare>::accessor node;
+	if (ChannelDirectory.insert(node, key)) {
+		// Create channel if it doesnt exist
+		Channel* created = Channels.acquire();
+		created->key = key;
+		created->listed = true;
+		node->second = created->id;
+	}
+	Channel* channel = Channels.get(node->second);
+	client->channelId = channel->id;
+	channel->add(client);
+}
+
+// Erases channel if it has no remaining users and no deliveries in flight
+void ReleaseChannel(Channel* channel) {
+	if (channel == reGlobalChannel || channel->population || channel->inFlight) {
+		return;
+	}
+
+	// Somebody may have joined (or erased it) before the entry was locked
+	tbb::concurrent_hash_map<ChannelKey, uint32_t, ChannelKeyHashCompare>::accessor node;
+	if (ChannelDirectory.find(node, channel->key) && node->second == channel->id && !channel->population && !channel->inFlight) {
+		channel->listed = false;
+		ChannelDirectory.erase(node);
+		Retire(channel, [](void* p) { Channels.release((Channel*)p); });
+	}
+}
+
+void LeaveChannel(Session* client) {
+	if (client->channelId == NO_CHANNEL) {
+		return;
+	}
+	Channel* channel = Channels.get(client->channelId);
+	if (client->watchCount) {
+		ChannelVariables &variables = channel->variables;
+		tbb::spin_rw_mutex::scoped_lock lock(variables.lock, true);
+		variables.watches.erase(std::remove_if(variables.watches.begin(), variables.watches.end(), [client](const VariableWatch &watch) {
+			return watch.session == client;
+		}), variables.watches.end());
+		client->watchCount = 0;
+	}
+	channel->remove(client);
+	ReleaseChannel(channel);
+}
+
+
+/////////////////////
+// DELIVERY
+/////////////////
+
+void NotifyDisconnect(Session* client, uint64_t userId);
+
+// Invalidates a Session, unlinks it from every lookup table and retires it
+// NOTICE: Must be called by client->owner, since it releases the owner's slot
+void RetireSession(Session* client) {
+	if (client->valid) {
+		// The userId may have been handed to another Session by relay op 3
+		bool ownsUserId = FindSession(client->userId) == client;
+		{
+			tbb::concurrent_hash_map<uint64_t, Session*>::accessor node;
+			if (CustomUserIDs.find(node, client->userId) && node->second == client) {
+				CustomUserIDs.erase(node);
+			}
+		}
+
+		client->valid = false;
+		client->owner->slots.remove(client->slot);
+
+		// Announce the disconnection while client still holds its channel, a client whose userId was taken
+		// leaves as UserID 0 so its peers don't take the new holder for gone
+		NotifyDisconnect(client, ownsUserId ? client->userId : 0);
+
+		SetListenerMode(client, NoMessages);
+		LeaveChannel(client);
+
+		// The socket outlives the Session until its close handshake is done
+		client->webSocket->setUserData(nullptr);
+		Retire(client);
+	}
+}
+
+void DisconnectClient(Session* client, uWS::WebSocket<uWS::SERVER> *ws, int code, const char* msg, int msg_len);
+
+void PostDelivery(RelayThread* destination, Delivery* delivery) {
+	RelayThread* self = LocalThread;
+	Outbox &outbox = self->outboxes[destination->index];
+	if (!outbox.head) {
+		self->pendingOutboxes.push_back(destination->index);
+	}
+	outbox.push(delivery);
+}
+
+void PostDelivery(Session* target, Delivery* delivery) {
+	delivery->slot = target->slot;
+	delivery->generation = target->generation;
+	PostDelivery(target->owner, delivery);
+}
+
+// Sends a message to target, directly if this thread owns it or through the owner's mailbox otherwise
+void Deliver(Session* target, const char* message, size_t length, uWS::OpCode code) {
+	if (target->owner == LocalThread) {
+		target->webSocket->send(message, length, code);
+		return;
+	}
+
+	Delivery* delivery = AllocDelivery(length);
+	delivery->kind = DeliverMessage;
+	delivery->opCode = code;
+	delivery->length = length;
+	memcpy(delivery->data, message, length);
+	PostDelivery(target, delivery);
+}
+
+// Disconnects target, directly if this thread owns it or through the owner's mailbox otherwise
+void RequestClose(Session* target, int code, const char* msg, int msg_len) {
+	if (target->owner == LocalThread) {
+		DisconnectClient(target, target->webSocket, code, msg, msg_len);
+		return;
+	}
+
+	Delivery* delivery = AllocDelivery(msg_len);
+	delivery->kind = DeliverClose;
+	delivery->closeCode = (uint16_t)code;
+	delivery->length = msg_len;
+	memcpy(delivery->data, msg, msg_len);
+	PostDelivery(target, delivery);
+}
+
+/*
+		Slow Consumers
+	> A client that stops reading makes its socket queue every message
+	relayed to it.  Once the queue reaches BACKPRESSURE_HIGH_WATERMARK the
+	socket is backpressured until it drains to BACKPRESSURE_LOW_WATERMARK,
+	and BACKPRESSURE_POLICY decides what happens to relayed messages:
+
+	SlowConsumerClose      - closes the client with CLOSE_TRY_AGAIN_LATER
+	SlowConsumerDropNew    - drops new messages until it has recovered
+	SlowConsumerDropOldest - drops queued messages down to the low watermark
+
+	Replies of the relay to the client's own requests are always sent,
+	though SlowConsumerDropOldest may later drop them from the queue.
+*/
+enum SlowConsumerPolicy {
+	SlowConsumerClose,
+	SlowConsumerDropNew,
+	SlowConsumerDropOldest
+};
+
+// Applies BACKPRESSURE_POLICY to a backpressured socket of self, returns true if it still gets the message
+// NOTICE: Never closes right away, SendPrepared is called while iterating member lists
+bool AdmitSlowConsumer(RelayThread* self, uWS::WebSocket<uWS::SERVER>* ws) {
+	Session* client = (Session*)ws->getUserData();
+	if (!client || !client->valid) {
+		return true;
+	}
+	if (!client->slowConsumer) {
+		client->slowConsumer = true;
+		AddRelayCounter(self->counters.slowConsumers, 1);
+		if (BACKPRESSURE_POLICY == SlowConsumerClose) {
+			self->slowConsumers.push_back(client);
+		}
+	}
+
+	switch (BACKPRESSURE_POLICY) {
+	case SlowConsumerDropOldest: {
+		AddRelayCounter(self->counters.droppedMessages, ws->dropBuffered(BACKPRESSURE_LOW_WATERMARK));
+		return true;
+	}
+	default: {
+		AddRelayCounter(self->counters.droppedMessages, 1);
+		return false;
+	}
+	}
+}
+
+// Sends a relayed message to a socket of this thread, subject to BACKPRESSURE_POLICY
+inline void SendPrepared(uWS::WebSocket<uWS::SERVER>* ws, PreparedMessage* prepared) {
+	RelayThread* self = LocalThread;
+	if (ws->isBackpressured() && !AdmitSlowConsumer(self, ws)) {
+		return;
+	}
+	ws->sendPrepared(prepared);
+
+	if ((prepared->buffer[0] & 0x0F) == uWS::OpCode::TEXT) {
+		AddRelayCounter(self->counters.textOut, 1);
+		AddRelayCounter(self->counters.textBytesOut, prepared->length);
+	}
+	else {
+		AddRelayCounter(self->counters.binaryOut, 1);
+		AddRelayCounter(self->counters.binaryBytesOut, prepared->length);
+	}
+}
+
+// Closes the slow consumers found during this loop iteration (Loop::postCb, before FlushOutboxes)
+void CloseSlowConsumers(RelayThread* self) {
+	for (size_t i = 0; i < self->slowConsumers.size(); i++) {
+		Session* client = self->slowConsumers[i];
+		if (client->valid) {
+			// Nothing queued is worth waiting for, let the close frame through
+			uWS::WebSocket<uWS::SERVER>* ws = client->webSocket;
+			AddRelayCounter(self->counters.droppedMessages, ws->dropBuffered(0));
+			DisconnectClient(client, ws, CLOSE_TRY_AGAIN_LATER, MSG_SLOW_CONSUMER, sizeof(MSG_SLOW_CONSUMER));
+		}
+	}
+	self->slowConsumers.clear();
+}
+
+// Sends prepared to every session of self (re_globl broadcasts)
+void SendToEverybody(RelayThread* self, PreparedMessage* prepared, uWS::WebSocket<uWS::SERVER>* except) {
+	self->slots.forEach([&](Session* v) {
+		if (v->webSocket != except) {
+			SendPrepared(v->webSocket, prepared);
+		}
+	});
+}
+
+// Sends prepared to the members of one thread
+void SendToMembers(ChannelMembers &members, PreparedMessage* prepared, uWS::WebSocket<uWS::SERVER>* except) {
+	for (ChannelMember &member : members.list) {
+		if (member.webSocket != except) {
+			SendPrepared(member.webSocket, prepared);
+		}
+	}
+}
+
+/*
+		Frame-Once Broadcasts
+	> The payload is framed into a PreparedMessage when the first recipient
+	is found, and every recipient shares that frame.  Sessions of this
+	thread get it through sendPrepared right away.  Channel members of other
+	threads get one DeliverMembers per thread and relay-wide broadcasts one
+	DeliverEverybody per thread, so each thread serves its own sockets.
+	Single sessions of other threads are grouped into one DeliverPrepared
+	per owning thread by finish().
 */
-struct Session {
-	uWS::WebSocket<uWS::SERVER>* webSocket;
-	std::time_t timeOfConnection;  // When connection occured (GMT+0)
-	uint64_t userId;
+struct Broadcast {
+	char* message;
+	size_t length;
+	uWS::OpCode code;
+	PreparedMessage* prepared;
+	uint64_t started;  // For LATENCY_FANOUT, 0 while latency is disabled
+
+	Broadcast(char* message, size_t length, uWS::OpCode code) : message(message), length(length), code(code), prepared(nullptr) {
+		started = LocalThread->latency.isEnabled() ? uS::Latency::now() : 0;
+	}
 
-	const std::string* channelName;                        // Name of the Channel the user is in
-	tbb::concurrent_unordered_set<Session*>* channelIndex; // Pointer to channel array for user's channel
-	std::atomic<bool> valid;                               // Is socket still valid (1 if ready, 0 if disconnected and pending deletion)
-	int listenerMode;
-	int authLevel;   // Level 1 = Relay Query & Listener Authentication
+	void prepare() {
+		if (!prepared) {
+			prepared = uWS::WebSocket<uWS::SERVER>::prepareMessage(message, length, code, false);
+		}
+	}
 
-	Session(uWS::WebSocket<uWS::SERVER>* ws) {
-		// Setup Session
-		this->webSocket = ws;
-		this->timeOfConnection = std::time(nullptr);
-		this->valid        = true;
-		this->listenerMode = 0;
-		this->authLevel    = 0;
+	// Sends to members (one per Hub thread) but except, channel is pinned while deliveries are in flight
+	void toMembers(ChannelMembers* members, Channel* channel, Session* except) {
+		RelayThread* self = LocalThread;
+		for (int i = 0; i < RelayThreadCount; i++) {
+			if (!members[i].count.load(std::memory_order_relaxed)) {
+				continue;
+			}
+			prepare();
 
-		// Generate values until finding an unused userId
-		uint64_t tmpUserId;
-		do {
-			tmpUserId = rand64p();
-		} while(UserIDSessionMap.count(tmpUserId));
-		this->userId = tmpUserId;
-		UserIDSessionMap[this->userId] = this;
+			uWS::WebSocket<uWS::SERVER>* exceptWs = (except && except->owner->index == i) ? except->webSocket : nullptr;
+			if (i == self->index) {
+				SendToMembers(members[i], prepared, exceptWs);
+				continue;
+			}
 
-		// Populate Lookup Tables
-		ws->setUserData(this);
+			Delivery* delivery = AllocDelivery(0);
+			delivery->kind = DeliverMembers;
+			delivery->prepared = prepared;
+			delivery->members = members;
+			delivery->channel = channel;
+			delivery->except = exceptWs;
+			prepared->references++;
+			if (channel) {
+				channel->inFlight++;
+			}
+			PostDelivery(RelayThreads[i], delivery);
+		}
 	}
 
-	// Destructor MUST be performed while mutex is held preventing iterator access
-	~Session() {
-		// Erase UserId from userId->Session map
-		// NOTICE: The userId will be NULL if original is requested by another Session
-		if (this->userId) {
-			UserIDSessionMap.unsafe_erase(this->userId);
+	// Sends to every member of channel but except
+	// NOTICE: except must be a member of channel, or another reference must keep channel alive
+	void toChannel(Channel* channel, Session* except) {
+		toMembers(channel->members, channel, except);
+	}
+
+	// Sends to the 're_globl' members listening for mode (one Message Mode Mask bit) but except
+	void toListeners(int mode, Session* except) {
+		for (int i = 0; i < LISTENER_KINDS; i++) {
+			if ((mode >> i) & 1) {
+				if (Listeners[i].population.load(std::memory_order_relaxed)) {
+					toMembers(Listeners[i].members, nullptr, except);
+				}
+				return;
+			}
 		}
+	}
 
-		// Erase session from the channel
-		this->channelIndex->unsafe_erase(this);
+	// Sends to every session on the relay but except, each Hub thread serves its own sessions
+	void toEverybody(Session* except) {
+		RelayThread* self = LocalThread;
+		for (int i = 0; i < RelayThreadCount; i++) {
+			if (!RelayThreads[i]->slots.population.load(std::memory_order_relaxed)) {
+				continue;
+			}
+			prepare();
 
-		// If the channel has no remaining users, remove it
-		if ((this->channelIndex->size() == 0) && !(this->channelIndex==reGlobalChannelIndex)) {
-			
-			// this->channelName is tied to the ClientTable entry so we make a copy of the string (not sure if required)
-			auto &tmpName = *this->channelName; 
-			ChannelClientTable.unsafe_erase(tmpName);
-			ChannelVariables.unsafe_erase(tmpName);
-		}
+			uWS::WebSocket<uWS::SERVER>* exceptWs = (except && except->owner->index == i) ? except->webSocket : nullptr;
+			if (i == self->index) {
+				SendToEverybody(self, prepared, exceptWs);
+				continue;
+			}
 
-		// Erase session from global session list
-		SessionExists.unsafe_erase(this);
+			Delivery* delivery = AllocDelivery(0);
+			delivery->kind = DeliverEverybody;
+			delivery->prepared = prepared;
+			delivery->except = exceptWs;
+			prepared->references++;
+			PostDelivery(RelayThreads[i], delivery);
+		}
 	}
-};
 
+	void to(Session* target) {
+		prepare();
 
-/////////////////////
-// GARBAGE COLLECTION 
-/////////////////
-struct AcquireGarbageLock {
-	AcquireGarbageLock() {
-		WAIT_FOR_GC();
-		gc_State++;
+		RelayThread* self = LocalThread;
+		if (target->owner == self) {
+			SendPrepared(target->webSocket, prepared);
+			return;
+		}
+
+		std::vector<DeliveryTarget> &targets = self->fanout[target->owner->index];
+		if (targets.empty()) {
+			self->fanoutThreads.push_back(target->owner->index);
+		}
+		targets.push_back({ target->slot, target->generation });
 	}
-	~AcquireGarbageLock() {
-		gc_State--;
+
+	// Posts the grouped deliveries, returns the number of frames built (0 without recipients)
+	int finish() {
+		RelayThread* self = LocalThread;
+		for (int index : self->fanoutThreads) {
+			std::vector<DeliveryTarget> &targets = self->fanout[index];
+			Delivery* delivery = AllocDelivery(targets.size() * sizeof(DeliveryTarget));
+			delivery->kind = DeliverPrepared;
+			delivery->prepared = prepared;
+			delivery->length = targets.size();
+			memcpy(delivery->data, targets.data(), targets.size() * sizeof(DeliveryTarget));
+			prepared->references++;
+			PostDelivery(RelayThreads[index], delivery);
+			targets.clear();
+		}
+		self->fanoutThreads.clear();
+
+		int frames = 0;
+		if (prepared) {
+			uWS::WebSocket<uWS::SERVER>::finalizeMessage(prepared);
+			prepared = nullptr;
+			frames = 1;
+		}
+		AddRelayCounter(self->counters.broadcasts, 1);
+		AddRelayCounter(self->counters.framesBuilt, frames);
+		if (started) {
+			self->latency.record(uS::LATENCY_FANOUT, uS::Latency::now() - started);
+		}
+		return frames;
 	}
 };
 
-void FreeGarbage() {
-	// Busy wait until we can cleanup safely (and hope this doesn't take forever)
-	WAIT_FOR_RELAY();
-	gc_State = -1;
+// Sends the disconnect event of client to its channel and to 're_globl' listeners
+// NOTICE: client must still be a member of its channel
+void NotifyDisconnect(Session* client, uint64_t userId) {
+	uint64_t dcMsgBuf[2];
+	dcMsgBuf[0] = RE_BROADCAST_TARGET; // Disconnection events come from the UserID: RE_BROADCAST_TARGET
+	dcMsgBuf[1] = userId;
+
+	// Send disconnect event to clients in the same channel
+	Broadcast broadcast((char*)(&dcMsgBuf[0]), 16, uWS::OpCode::BINARY);
+	broadcast.toChannel(Channels.get(client->channelId), client);
+
+	// Send to disconnect events to users in 're_globl' channel with DisconnectMessage flag set in listenerMode 
+	if (client->channelId != reGlobalChannel->id) {
+		broadcast.toListeners(DisconnectMessage, client);
+	}
+	broadcast.finish();
+}
 
-	Session* client;
-	while (GarbageQueue.try_pop(client)) {
-		delete client;
+// Hands every pending outbox to its destination in one batch (end of loop iteration)
+void FlushOutboxes(RelayThread* self) {
+	for (int index : self->pendingOutboxes) {
+		Outbox &outbox = self->outboxes[index];
+		RelayThread* destination = RelayThreads[index];
+		if (destination->mailbox.push(outbox.head, outbox.tail)) {
+			destination->async->send();
+		}
+		outbox.head = outbox.tail = nullptr;
 	}
+	self->pendingOutboxes.clear();
+}
 
-	gc_State = 0;
+// Performs deliveries posted by other threads (uS::Async callback)
+void DrainMailbox(uS::Async* async) {
+	RelayThread* self = (RelayThread*)async->getData();
+
+	Delivery* delivery = self->mailbox.drain();
+	while (delivery) {
+		Delivery* next = delivery->next;
+		if (delivery->kind == DeliverPrepared) {
+			DeliveryTarget* targets = (DeliveryTarget*)delivery->data;
+			for (size_t i = 0; i < delivery->length; i++) {
+				Session* target = self->slots.resolve(targets[i].slot, targets[i].generation);
+				if (target && target->valid) {
+					SendPrepared(target->webSocket, delivery->prepared);
+				}
+			}
+			uWS::WebSocket<uWS::SERVER>::finalizeMessage(delivery->prepared);
+		}
+		else if (delivery->kind == DeliverMembers) {
+			SendToMembers(delivery->members[self->index], delivery->prepared, delivery->except);
+			uWS::WebSocket<uWS::SERVER>::finalizeMessage(delivery->prepared);
+			if (delivery->channel) {
+				delivery->channel->inFlight--;
+				ReleaseChannel(delivery->channel);
+			}
+		}
+		else if (delivery->kind == DeliverEverybody) {
+			SendToEverybody(self, delivery->prepared, delivery->except);
+			uWS::WebSocket<uWS::SERVER>::finalizeMessage(delivery->prepared);
+		}
+		else {
+			Session* target = self->slots.resolve(delivery->slot, delivery->generation);
+			if (target && target->valid) {
+				switch (delivery->kind) {
+				case DeliverMessage:
+					target->webSocket->send(delivery->data, delivery->length, delivery->opCode);
+					break;
+				case DeliverClose:
+					DisconnectClient(target, target->webSocket, delivery->closeCode, delivery->data, (int)delivery->length);
+					break;
+				}
+			}
+		}
+		free(delivery);
+		delivery = next;
+	}
 }
 
 
@@ -277,59 +1471,229 @@ void FreeGarbage() {
 /////////////////
 void AssignChannelVariable(uWS::WebSocket<uWS::SERVER>* ws, char* key, uint32_t key_length, char* value, uint32_t value_length) {
 	Session* client = (Session*)ws->getUserData();
-	std::string channelName = *client->channelName;
-	auto node = ChannelVariables.find(channelName);
-	if (node == ChannelVariables.end()) {
-		// Create channel if it doesnt exist
-		auto insert = ChannelVariables.insert(std::make_pair(channelName, tbb::concurrent_unordered_map<std::string, std::string>()));
-	}
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
 	std::string keyStr(key, key_length);
-	std::string valueStr(value, value_length);
-	ChannelVariables[channelName][keyStr] = valueStr;
+	tbb::spin_rw_mutex::scoped_lock lock(variables.lock, true);
+	variables.set(keyStr, value, value_length);
+	if (variables.watches.size()) {
+		client->owner->changedVariables.push_back({ client->channelId, keyStr });
+	}
 }
 
 const char* EmptyVariableReturnPacket = "\x00\x00\x00\x00\x00\x00\x00\x00\xC8";
 void TransmitChannelVariable(uWS::WebSocket<uWS::SERVER>* ws, char* key, uint32_t key_length) {
 	Session* client = (Session*)ws->getUserData();
-	std::string channelName = *client->channelName;
-	auto channelNode = ChannelVariables.find(channelName);
-	if (channelNode == ChannelVariables.end()) {
-		// Send empty packet if no channel vars exists
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
+	std::string keyStr(key, key_length);
+	tbb::spin_rw_mutex::scoped_lock lock(variables.lock, false);
+	const ChannelVariable* variable = variables.find(keyStr, SteadyMilliseconds());
+	if (!variable) {
+		// Send empty packet if var not found
 		ws->send(EmptyVariableReturnPacket, 9, uWS::OpCode::BINARY);
 	}
 	else {
-		auto channelVariables = channelNode->second;
-		std::string keyStr(key, key_length);
-		auto channelVarNode = channelVariables.find(keyStr);
-		if (channelVarNode == channelVariables.end()) {
-			// Send empty packet if var not found
-			ws->send(EmptyVariableReturnPacket, 9, uWS::OpCode::BINARY);
+		ws->send(variables.reply(variable), VARIABLE_HEADER_LENGTH + variable->length, uWS::OpCode::BINARY);
+	}
+}
+
+// Replies [RE_RELAY_TARGET][202] then [8-byte version][4-byte length][value] per requested key, version 0 if unset
+bool TransmitChannelVariables(uWS::WebSocket<uWS::SERVER>* ws, char* keys, size_t length) {
+	Session* client = (Session*)ws->getUserData();
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
+	static thread_local std::vector<char> buffer;
+	static thread_local std::string keyStr;
+	buffer.resize(VARIABLE_HEADER_LENGTH);
+	*(uint64_t*)&buffer[0] = RE_RELAY_TARGET;
+	buffer[8] = (char)202;
+	{
+		tbb::spin_rw_mutex::scoped_lock lock(variables.lock, false);
+		int64_t now = SteadyMilliseconds();
+		for (size_t cur = 0; cur < length;) {
+			uint8_t key_length = (uint8_t)keys[cur++];
+			if (!key_length || cur + key_length > length) { return false; }
+			keyStr.assign(&keys[cur], key_length); cur += key_length;
+
+			const ChannelVariable* variable = variables.find(keyStr, now);
+			uint64_t version = variable ? variable->version : 0;
+			uint32_t value_length = variable ? variable->length : 0;
+			size_t end = buffer.size();
+			buffer.resize(end + 8 + 4 + value_length);
+			*(uint64_t*)&buffer[end] = version;
+			*(uint32_t*)&buffer[end + 8] = value_length;
+			if (value_length) {
+				memcpy(&buffer[end + 12], variables.reply(variable) + VARIABLE_HEADER_LENGTH, value_length);
+			}
 		}
-		else {
-			size_t returnSize = 8/*userId*/ + 1/*opcode*/ + channelVarNode->second.size();
-			char* buffer = (char*)malloc(returnSize);
-			char* cur = (char*)buffer;
+	}
+	ws->send(buffer.data(), buffer.size(), uWS::OpCode::BINARY);
+	return true;
+}
+
+// Sets every [1-byte key length][key][4-byte value length][value] in one write, nothing is set if any is malformed
+bool AssignChannelVariables(uWS::WebSocket<uWS::SERVER>* ws, char* pairs, size_t length) {
+	Session* client = (Session*)ws->getUserData();
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
+	for (size_t cur = 0; cur < length;) {
+		uint8_t key_length = (uint8_t)pairs[cur++];
+		if (!key_length || cur + key_length + 4 > length) { return false; }
+		cur += key_length;
+		uint32_t value_length = *(uint32_t*)&pairs[cur]; cur += 4;
+		if (value_length > length - cur) { return false; }
+		cur += value_length;
+	}
+
+	static thread_local std::string keyStr;
+	tbb::spin_rw_mutex::scoped_lock lock(variables.lock, true);
+	for (size_t cur = 0; cur < length;) {
+		uint8_t key_length = (uint8_t)pairs[cur++];
+		keyStr.assign(&pairs[cur], key_length); cur += key_length;
+		uint32_t value_length = *(uint32_t*)&pairs[cur]; cur += 4;
+		variables.set(keyStr, &pairs[cur], value_length); cur += value_length;
+		if (variables.watches.size()) {
+			client->owner->changedVariables.push_back({ client->channelId, keyStr });
+		}
+	}
+	return true;
+}
+
+// Sets the variable only if its version still matches, replies [RE_RELAY_TARGET][203][1-byte swapped][8-byte version now held]
+void CompareAndSetChannelVariable(uWS::WebSocket<uWS::SERVER>* ws, uint64_t expected, char* key, uint32_t key_length, char* value, uint32_t value_length) {
+	Session* client = (Session*)ws->getUserData();
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
+	std::string keyStr(key, key_length);
+	char buffer[VARIABLE_HEADER_LENGTH + 1 + 8];
+	char* cur = (char*)buffer;
+	*(uint64_t*)cur = RE_RELAY_TARGET; cur += 8;
+	*cur = (char)203; cur += 1;
+	{
+		tbb::spin_rw_mutex::scoped_lock lock(variables.lock, true);
+		const ChannelVariable* variable = variables.find(keyStr, SteadyMilliseconds());
+		uint64_t current = variable ? variable->version : 0;
+		bool swapped = current == expected;
+		*cur = (char)swapped; cur += 1;
+		*(uint64_t*)cur = swapped ? variables.set(keyStr, value, value_length) : current; cur += 8;
+		if (swapped && variables.watches.size()) {
+			client->owner->changedVariables.push_back({ client->channelId, keyStr });
+		}
+	}
+	ws->send(buffer, sizeof(buffer), uWS::OpCode::BINARY);
+}
+
+void ExpireChannelVariable(uWS::WebSocket<uWS::SERVER>* ws, uint32_t ttl, char* key, uint32_t key_length) {
+	Session* client = (Session*)ws->getUserData();
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
+	std::string keyStr(key, key_length);
+	tbb::spin_rw_mutex::scoped_lock lock(variables.lock, true);
+	variables.expire(keyStr, ttl, SteadyMilliseconds());
+}
+
+// Adds (or with watch false, removes) a watch on key, a prefix watch matches every key starting with it
+bool WatchChannelVariable(Session* client, bool watch, bool prefix, char* key, uint32_t key_length) {
+	ChannelVariables &variables = Channels.get(client->channelId)->variables;
+	std::string keyStr(key, key_length);
+	tbb::spin_rw_mutex::scoped_lock lock(variables.lock, true);
+	auto existing = std::find_if(variables.watches.begin(), variables.watches.end(), [&](const VariableWatch &entry) {
+		return entry.session == client && entry.prefix == prefix && entry.key == keyStr;
+	});
+	if (!watch) {
+		if (existing != variables.watches.end()) {
+			*existing = std::move(variables.watches.back());
+			variables.watches.pop_back();
+			client->watchCount--;
+		}
+		return true;
+	}
+	if (existing != variables.watches.end()) {
+		return true;
+	}
+	if (client->watchCount >= MAX_VARIABLE_WATCHES) {
+		return false;
+	}
+	variables.watches.push_back({ client, keyStr, prefix });
+	client->watchCount++;
+	return true;
+}
+
+// Pushes [RE_RELAY_TARGET][204][8-byte version][1-byte key length][key][value] to the watchers
+// of every variable written during this loop iteration (Loop::postCb, before FlushOutboxes)
+void FlushVariableChanges(RelayThread* self) {
+	std::vector<VariableChange> &changes = self->changedVariables;
+	if (changes.empty()) {
+		return;
+	}
+	std::sort(changes.begin(), changes.end());
+	changes.erase(std::unique(changes.begin(), changes.end()), changes.end());
+
+	static thread_local std::vector<char> buffer;
+	static thread_local std::vector<Session*> watchers;
+	int64_t now = SteadyMilliseconds();
+	for (VariableChange &change : changes) {
+		ChannelVariables &variables = Channels.get(change.channelId)->variables;
+		{
+			tbb::spin_rw_mutex::scoped_lock lock(variables.lock, false);
+			const ChannelVariable* variable = variables.find(change.key, now);
+			if (!variable) {
+				continue;
+			}
+			for (const VariableWatch &watch : variables.watches) {
+				if (watch.matches(change.key)) {
+					watchers.push_back(watch.session);
+				}
+			}
+			if (watchers.empty()) {
+				continue;
+			}
+
+			buffer.resize(VARIABLE_HEADER_LENGTH + 8 + 1 + change.key.size() + variable->length);
+			char* cur = buffer.data();
 			*(uint64_t*)cur = RE_RELAY_TARGET; cur += 8;
-			*cur = (char)200; cur += 1;
-			const char* valueData  = channelVarNode->second.data();
-			size_t valueLength = channelVarNode->second.length();
-			memcpy(cur, valueData, valueLength); cur += valueLength;
-			ws->send(buffer, returnSize, uWS::OpCode::BINARY);
-			free(buffer);
+			*cur = (char)204; cur += 1;
+			*(uint64_t*)cur = variable->version; cur += 8;
+			*(uint8_t*)cur = (uint8_t)change.key.size(); cur += 1;
+			memcpy(cur, change.key.data(), change.key.size()); cur += change.key.size();
+			memcpy(cur, variables.reply(variable) + VARIABLE_HEADER_LENGTH, variable->length);
+		}
+
+		// Watchers stay allocated until this thread leaves its epoch
+		Broadcast broadcast(buffer.data(), buffer.size(), uWS::OpCode::BINARY);
+		for (Session* watcher : watchers) {
+			if (watcher->valid) {
+				broadcast.to(watcher);
+			}
 		}
+		broadcast.finish();
+		watchers.clear();
 	}
+	changes.clear();
 }
 
 
+// NOTICE: Must be called by the thread owning ws, use RequestClose for sessions of other threads
 void DisconnectClient(Session* client, uWS::WebSocket<uWS::SERVER> *ws, int code, const char* msg, int msg_len) {
 	if (client) {
-		client->valid = false;
-		GarbageQueue.push(client);
+		RetireSession(client);
 	}
 	ws->close(code, msg, msg_len);
 }
 
 
+//   RateLimitValid
+// RETURNS
+//     Returns true if the message fits the client's budget for kind, otherwise returns false.
+// REMARKS
+//     Disconnects clients exceeding their budget, see Flood Protection.
+bool RateLimitValid(Session* client, uWS::WebSocket<uWS::SERVER> *ws, RateClass kind, size_t length) {
+	RelayThread* self = client->owner;
+	const RateLimit &limit = RateLimits[client->authLevel >= 1][kind];
+	if (client->buckets[kind].take(limit, self->loopTime, length)) {
+		return true;
+	}
+	AddRelayCounter(self->counters.rateLimited, 1);
+	DisconnectClient(client, ws, CLOSE_POLICY_VIOLATION, MSG_RATE_LIMIT_EXCEEDED, sizeof(MSG_RATE_LIMIT_EXCEEDED));
+	return false;
+}
+
+
 //   MessageSizeValid
 // RETURNS
 //     Returns true if minimum message size is enough, otherwise returns false.
@@ -372,34 +1736,25 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 	switch (*targetUserID) {
 		// BROADCAST MESSAGE
 		case RE_BROADCAST_TARGET: {			
+			if (!RateLimitValid(client, ws, RateBroadcast, length))
+				return false;
+
 			// Overwrite message with sender's UserID
 			*targetUserID = client->userId;
 
 			// SPECIAL re_globl broadcast-message is sent to entire relay
-			if (client->channelIndex == reGlobalChannelIndex) {
-				for (auto &v : SessionExists) {
-					if (!(ws == ((v->webSocket))) && v->valid) {
-						((v->webSocket))->send(message, length, code);
-					}
-				}
+			Broadcast broadcast(message, length, code);
+			if (client->channelId == reGlobalChannel->id) {
+				broadcast.toEverybody(client);
 			}
 			else {
 				// Send to just the channel
-				for (auto &v : *client->channelIndex) {
-					if (!(ws == ((v->webSocket))) && v->valid) {
-						((v->webSocket))->send(message, length, code);
-					}
-				}
+				broadcast.toChannel(Channels.get(client->channelId), client);
 
 				// Send to users in 're_globl' channel with re_spy::channelmsg flag
-				for (auto &v : *reGlobalChannelIndex) {
-					if (!(ws == ((v->webSocket))) && v->valid) {
-						if (v->listenerMode & ChannelMessage) { // Check global Relay Channel listening bit
-							((v->webSocket))->send(message, length, code);
-						}
-					}
-				}
+				broadcast.toListeners(ChannelMessage, client);
 			}
+			broadcast.finish();
 			break;
 		}
 
@@ -408,6 +1763,8 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 			char msgBuffer[24];
 			size_t msgLen;
 			if (length < 9) { return false; }
+			if (!RateLimitValid(client, ws, RateRelay, length))
+				return false;
 			switch (message[8]) {
 			case 0: {
 				msgLen = length - 9;
@@ -426,7 +1783,7 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 			case 1: {
 				if (length != 10) { return false; }
 				if (client->authLevel == 1) {
-					client->listenerMode = message[9];
+					SetListenerMode(client, message[9]);
 				}
 				break;
 			}
@@ -436,22 +1793,33 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 					size_t numberOfChannels = 0;
 					size_t stringTotal = 0;
 					size_t payloadSize;
-					for (auto &v : ChannelClientTable) {
+
+					// Snapshot the pool once, channels may be created while the reply is built
+					// (ids are only recycled after a quiescent state, so listed channels keep their key until we return)
+					std::vector<Channel*> channels;
+					uint32_t poolSize = Channels.size.load(std::memory_order_acquire);
+					for (uint32_t id = 0; id < poolSize; id++) {
+						Channel* channel = Channels.get(id);
+						if (channel->listed) {
+							channels.push_back(channel);
+						}
+					}
+					for (auto &v : channels) {
 						numberOfChannels++;
-						stringTotal += v.first.length();
+						stringTotal += v->key.length;
 					}
 					payloadSize = 8/*sender UserID*/ + 4/*number of channels*/ + numberOfChannels/*1-byte strlen*/ + stringTotal/*strings*/ + numberOfChannels * 4 /*4-byte population*/;
 					char* buffer = (char*)malloc(payloadSize);
 					char* cur = (char*)buffer;
 					*(uint64_t*)cur = RE_RELAY_TARGET; cur += 8;
 					*(uint32_t*)cur = numberOfChannels; cur += 4;
-					for (auto &v : ChannelClientTable) {
-						uint8_t strLen = (uint8_t)v.first.length();
+					for (auto &v : channels) {
+						uint8_t strLen = (uint8_t)v->key.length;
 						*(uint8_t*)cur = (uint8_t)strLen; cur++;
-						v.first.copy(cur, strLen, 0); cur += strLen;
+						memcpy(cur, v->key.bytes, strLen); cur += strLen;
 					}
-					for (auto &v : ChannelClientTable) {
-						*(uint32_t*)cur = v.second.size(); cur += 4;
+					for (auto &v : channels) {
+						*(uint32_t*)cur = v->population; cur += 4;
 					}
 					ws->send(buffer, payloadSize, uWS::OpCode::BINARY);
 					free(buffer);
@@ -463,22 +1831,36 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 				msgLen = length - 9;
 				if (client->authLevel < 1) { return false; }
 				if (msgLen != 8) { return false; }
-				if (UserIDSessionMap.count(*(uint64_t*)(&message[9]))) {
-					Session* tmpclient = UserIDSessionMap[*(uint64_t*)(&message[9])];
-					tmpclient->userId = 0;
-					if (tmpclient->valid) {
-						DisconnectClient(tmpclient, tmpclient->webSocket, CLOSE_USERID_TAKEN, MSG_USERID_TAKEN, sizeof(MSG_USERID_TAKEN));
+				uint64_t requestedUserId = *(uint64_t*)(&message[9]);
+				Session* tmpclient;
+				{
+					// Custom UserIDs take precedence over the generated UserID they may equal
+					tbb::concurrent_hash_map<uint64_t, Session*>::accessor node;
+					if (CustomUserIDs.insert(node, requestedUserId)) {
+						tmpclient = FindGeneratedSession(requestedUserId);
+					}
+					else {
+						tmpclient = node->second;
+					}
+					node->second = client;
+				}
+				if (tmpclient && tmpclient != client && tmpclient->valid) {
+					RequestClose(tmpclient, CLOSE_USERID_TAKEN, MSG_USERID_TAKEN, sizeof(MSG_USERID_TAKEN));
+				}
+				if (client->userId != requestedUserId) {
+					tbb::concurrent_hash_map<uint64_t, Session*>::accessor node;
+					if (CustomUserIDs.find(node, client->userId) && node->second == client) {
+						CustomUserIDs.erase(node);
 					}
 				}
-				UserIDSessionMap[*(uint64_t*)(&message[9])] = client;
-				UserIDSessionMap.unsafe_erase(client->userId);
-				client->userId = *(uint64_t*)(&message[9]);
+				client->userId = requestedUserId;
 				break;
 			}
 			case 4: {
+				if (length < 10) { return false; }
 				uint8_t key_length = *(uint8_t*)&message[9];
-				uint32_t value_length = length - 10 - key_length;
-				if (key_length && value_length >= 0) {
+				if (key_length && 10 + (size_t)key_length <= length) {
+					uint32_t value_length = (uint32_t)(length - 10 - key_length);
 					AssignChannelVariable(ws, &message[10], key_length, &message[10 + key_length], value_length);
 				}
 				break;
@@ -490,6 +1872,63 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 				}
 				break;
 			}
+			case 6: {
+				// Relay statistics: broadcasts, WebSocket frames built for them, slow consumers, messages dropped for them
+				// and sessions closed for exceeding their rate limits
+				if (length != 9) { return false; }
+				if (client->authLevel == 1) {
+					char buffer[8 + 1 + 8 + 8 + 8 + 8 + 8];
+					char* cur = (char*)buffer;
+					*(uint64_t*)cur = RE_RELAY_TARGET; cur += 8;
+					*cur = (char)201; cur += 1;
+					*(uint64_t*)cur = SumRelayCounter(&RelayCounters::broadcasts); cur += 8;
+					*(uint64_t*)cur = SumRelayCounter(&RelayCounters::framesBuilt); cur += 8;
+					*(uint64_t*)cur = SumRelayCounter(&RelayCounters::slowConsumers); cur += 8;
+					*(uint64_t*)cur = SumRelayCounter(&RelayCounters::droppedMessages); cur += 8;
+					*(uint64_t*)cur = SumRelayCounter(&RelayCounters::rateLimited); cur += 8;
+					ws->send(buffer, sizeof(buffer), uWS::OpCode::BINARY);
+				}
+				break;
+			}
+			case 7: {
+				// Bulk get: [1-byte key length][key] repeated
+				if (length < 11) { return false; }
+				if (!TransmitChannelVariables(ws, &message[9], length - 9)) { return false; }
+				break;
+			}
+			case 8: {
+				// Bulk set: [1-byte key length][key][4-byte value length][value] repeated
+				if (length < 14) { return false; }
+				if (!AssignChannelVariables(ws, &message[9], length - 9)) { return false; }
+				break;
+			}
+			case 9: {
+				// Compare-and-set: [8-byte expected version][1-byte key length][key][value]
+				if (length < 19) { return false; }
+				uint64_t expected = *(uint64_t*)&message[9];
+				uint8_t key_length = *(uint8_t*)&message[17];
+				if (!key_length || 18 + (size_t)key_length > length) { return false; }
+				uint32_t value_length = (uint32_t)(length - 18 - key_length);
+				CompareAndSetChannelVariable(ws, expected, &message[18], key_length, &message[18 + key_length], value_length);
+				break;
+			}
+			case 10: {
+				// Expire: [4-byte TTL in milliseconds, 0 = persist][key]
+				if (length < 14) { return false; }
+				uint32_t ttl = *(uint32_t*)&message[9];
+				ExpireChannelVariable(ws, ttl, &message[13], (uint32_t)(length - 13));
+				break;
+			}
+			case 11:
+			case 12: {
+				// Watch (11) or unwatch (12): [1-byte 0 = key, 1 = prefix][key or prefix]
+				if (length < 10) { return false; }
+				bool prefix = message[9] == 1;
+				uint32_t key_length = (uint32_t)(length - 10);
+				if ((!prefix && !key_length) || key_length > 255) { return false; }
+				if (!WatchChannelVariable(client, message[8] == 11, prefix, &message[10], key_length)) { return false; }
+				break;
+			}
 			default:
 				DisconnectClient(client, ws, CLOSE_PROTOCOL_ERROR, MSG_PROTOCOL_VIOLATION, sizeof(MSG_PROTOCOL_VIOLATION));
 				break;
@@ -499,23 +1938,26 @@ bool HandleBinaryMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char
 
 		// PRIVATE MESSAGE
 		default: {
-			auto targetSession = UserIDSessionMap.find((uint64_t)*(size_t*)message); // Since message[0] has the target we just dereference with size_t
-			if (targetSession != UserIDSessionMap.end()) {
+			if (!RateLimitValid(client, ws, RatePrivate, length))
+				return false;
+
+			Session* targetSession = FindSession((uint64_t)*(size_t*)message); // Since message[0] has the target we just dereference with size_t
+			if (targetSession) {
 				*targetUserID = client->userId; // Prefix message with sender's UserID
 
+				Broadcast broadcast(message, length, code);
+
 				// Send Private Message to Target
-				if ((targetSession->second)->valid) {
-					(((targetSession->second)->webSocket))->send(message, length, code);
+				if (targetSession->valid) {
+					broadcast.to(targetSession);
 				}
 
 				// Send Private Message to users in 're_globl' channel with re_spy::privatemsg flag
-				for (auto &v : *reGlobalChannelIndex) {
-					if (!(targetSession->second == v) && v->valid) { // Make sure not to send twice if client is also the recipient, and that target is valid
-						if (v->listenerMode & PrivateMessage) {
-							((v->webSocket))->send(message, length, code);
-						}
-					}
-				}
+				broadcast.toListeners(PrivateMessage, targetSession); // Make sure not to send twice if client is also the recipient
+				broadcast.finish();
+			}
+			else {
+				AddRelayCounter(client->owner->counters.privateMisses, 1);
 			}
 			break;
 		}
@@ -536,59 +1978,56 @@ bool HandleTextMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char*
 	// Read and decode who the message is being sent to
 	unsigned char userIDbytes[8];
 	uint64_t *targetUserID = (uint64_t*)(&userIDbytes[0]);
-	dec64(message, 12, userIDbytes);
+	if (!DecodeUserId64(message, userIDbytes)) {
+		DisconnectClient(client, ws, CLOSE_PROTOCOL_ERROR, MSG_PROTOCOL_VIOLATION, sizeof(MSG_PROTOCOL_VIOLATION));
+		return false;
+	}
 
 	switch (*targetUserID) {
 
 		case RE_BROADCAST_TARGET: {
-			enc64((const char*)&(client->userId), 8, message);
+			if (!RateLimitValid(client, ws, RateBroadcast, length))
+				return false;
+
+			EncodeUserId64(&client->userId, message);
 
 			// SPECIAL re_globl broadcast-message is sent to entire relay
-			if (client->channelIndex == reGlobalChannelIndex) {
-				for (auto &v : SessionExists) {
-					if (!(ws == ((v->webSocket))) && v->valid) {
-						((v->webSocket))->send(message, length, code);
-					}
-				}
+			Broadcast broadcast(message, length, code);
+			if (client->channelId == reGlobalChannel->id) {
+				broadcast.toEverybody(client);
 			}
 			else {
 				// Send to just the channel
-				for (auto &v : *client->channelIndex) {
-					if (!(ws == ((v->webSocket))) && v->valid) {
-						((v->webSocket))->send(message, length, code);
-					}
-				}
+				broadcast.toChannel(Channels.get(client->channelId), client);
 
 				// Send to users in 're_globl' channel with ChannelMessage flag in listenerMode
-				for (auto &v : *reGlobalChannelIndex) {
-					if (!(ws == ((v->webSocket))) && v->valid) {
-						if (v->listenerMode & ChannelMessage) {
-							((v->webSocket))->send(message, length, code);
-						}
-					}
-				}
+				broadcast.toListeners(ChannelMessage, client);
 			}
+			broadcast.finish();
 			break;
 		}
 
 		default: {
-			auto targetSession = UserIDSessionMap.find((uint64_t)*targetUserID);
-			if (targetSession != UserIDSessionMap.end()) {
-				enc64((const char*)&(client->userId), 8, message);
+			if (!RateLimitValid(client, ws, RatePrivate, length))
+				return false;
+
+			Session* targetSession = FindSession((uint64_t)*targetUserID);
+			if (targetSession) {
+				EncodeUserId64(&client->userId, message);
+
+				Broadcast broadcast(message, length, code);
 
 				// Send to the private message target
-				if ((targetSession->second)->valid) {
-					(((targetSession->second)->webSocket))->send(message, length, code);
+				if (targetSession->valid) {
+					broadcast.to(targetSession);
 				}
 
 				// Send to users in 're_globl' channel with re_spy::privatemsg flag
-				for (auto &v : *reGlobalChannelIndex) {
-					if (!(targetSession->second == v) && v->valid) {
-						if (v->listenerMode & PrivateMessage) {
-							((v->webSocket))->send(message, length, code);
-						}
-					}
-				}
+				broadcast.toListeners(PrivateMessage, targetSession);
+				broadcast.finish();
+			}
+			else {
+				AddRelayCounter(client->owner->counters.privateMisses, 1);
 			}
 			break;
 		}
@@ -598,30 +2037,281 @@ bool HandleTextMessages(Session* client, uWS::WebSocket<uWS::SERVER> *ws, char*
 }
 
 
+/////////////////////
+// METRICS
+/////////////////
+struct RelayMetric {
+	const char* name;
+	const char* labels;  // Prometheus labels without braces, or NULL
+	const char* type;
+	const char* help;
+	std::atomic<uint64_t> RelayCounters::* counter;
+};
+
+// Entries of one name must be adjacent, HELP and TYPE are written for the first
+const RelayMetric RelayMetrics[] = {
+	{ "relay_connections_total",      NULL, "counter", "WebSocket connections accepted",  &RelayCounters::connections },
+	{ "relay_disconnections_total",   NULL, "counter", "WebSocket connections closed",    &RelayCounters::disconnections },
+	{ "relay_joins_total",            NULL, "counter", "Sessions that joined a channel",  &RelayCounters::joins },
+	{ "relay_tls_handshakes_total",   NULL, "counter", "TLS handshakes completed",        &RelayCounters::tlsHandshakes },
+	{ "relay_tls_kernel_total",       "direction=\"send\"",    "counter", "TLS handshakes after which kernel TLS took over the records, by direction", &RelayCounters::tlsKernelSend },
+	{ "relay_tls_kernel_total",       "direction=\"receive\"", "counter", NULL,                 &RelayCounters::tlsKernelReceive },
+	{ "relay_messages_in_total",      "type=\"text\"",   "counter", "Messages received from clients",  &RelayCounters::textIn },
+	{ "relay_messages_in_total",      "type=\"binary\"", "counter", NULL,                              &RelayCounters::binaryIn },
+	{ "relay_bytes_in_total",         "type=\"text\"",   "counter", "Message payload bytes received from clients", &RelayCounters::textBytesIn },
+	{ "relay_bytes_in_total",         "type=\"binary\"", "counter", NULL,                              &RelayCounters::binaryBytesIn },
+	{ "relay_messages_out_total",     "type=\"text\"",   "counter", "Relayed messages sent to clients, broadcast fan-out included", &RelayCounters::textOut },
+	{ "relay_messages_out_total",     "type=\"binary\"", "counter", NULL,                              &RelayCounters::binaryOut },
+	{ "relay_bytes_out_total",        "type=\"text\"",   "counter", "Relayed frame bytes sent to clients", &RelayCounters::textBytesOut },
+	{ "relay_bytes_out_total",        "type=\"binary\"", "counter", NULL,                              &RelayCounters::binaryBytesOut },
+	{ "relay_broadcasts_total",       NULL, "counter", "Broadcasts sent",                 &RelayCounters::broadcasts },
+	{ "relay_frames_built_total",     NULL, "counter", "WebSocket frames built for broadcasts", &RelayCounters::framesBuilt },
+	{ "relay_private_misses_total",   NULL, "counter", "Private messages to a UserId without session", &RelayCounters::privateMisses },
+	{ "relay_slow_consumers_total",   NULL, "counter", "Sessions that reached the backpressure high watermark", &RelayCounters::slowConsumers },
+	{ "relay_dropped_messages_total", NULL, "counter", "Relayed messages dropped for slow consumers", &RelayCounters::droppedMessages },
+	{ "relay_rate_limited_total",     NULL, "counter", "Sessions closed for exceeding their rate limits", &RelayCounters::rateLimited },
+	{ "relay_sessions",               NULL, "gauge",   "Sessions connected",              &RelayCounters::sessions },
+	{ "relay_queued_bytes",           NULL, "gauge",   "Bytes queued on sockets of sessions", &RelayCounters::queuedBytes },
+	{ "relay_retired_objects",        NULL, "gauge",   "Retired objects waiting for epoch reclamation", &RelayCounters::retiredObjects },
+	{ "relay_pool_allocations_total", "result=\"hit\"",  "counter", "Queued message allocations, by whether the message pool had a free block", &RelayCounters::poolHits },
+	{ "relay_pool_allocations_total", "result=\"miss\"", "counter", NULL,                            &RelayCounters::poolMisses },
+	{ "relay_pool_retained_bytes",    NULL, "gauge",   "Bytes held in the free lists of the message pools", &RelayCounters::poolRetainedBytes },
+	{ "relay_zerocopy_bytes_total",   "result=\"zerocopy\"", "counter", "Bytes sent with MSG_ZEROCOPY, by whether the kernel had to copy them after all", &RelayCounters::zeroCopiedBytes },
+	{ "relay_zerocopy_bytes_total",   "result=\"copied\"",   "counter", NULL,                      &RelayCounters::zeroCopyCopiedBytes },
+	{ "relay_zerocopy_bytes_total",   "result=\"abandoned\"", "counter", NULL,                     &RelayCounters::zeroCopyAbandonedBytes }
+};
+
+const char* LatencyStageNames[uS::LATENCY_STAGES] = { "read", "parse", "handler", "fanout", "queue" };
+
+// Writes p50, p99 and p999 of every uS::LatencyStage, merged over all Hub threads
+void RenderLatency(std::string &text) {
+	static const double quantiles[] = { 0.5, 0.99, 0.999 };
+	static const char* quantileNames[] = { "0.5", "0.99", "0.999" };
+	std::vector<uint64_t> counts(uS::LatencyHistogram::BUCKETS);
+	char line[256];
+
+	text += "# HELP relay_stage_latency_seconds Time messages spend per stage, recorded while latency is enabled\n";
+	text += "# TYPE relay_stage_latency_seconds summary\n";
+	for (int stage = 0; stage < uS::LATENCY_STAGES; stage++) {
+		uint64_t count = 0, total = 0;
+		std::fill(counts.begin(), counts.end(), 0);
+		for (int t = 0; t < RelayThreadCount; t++) {
+			uS::LatencyHistogram &histogram = RelayThreads[t]->latency.stages[stage];
+			for (int i = 0; i < uS::LatencyHistogram::BUCKETS; i++) {
+				uint64_t n = histogram.counts[i].load(std::memory_order_relaxed);
+				counts[i] += n;
+				count += n;
+			}
+			total += histogram.total.load(std::memory_order_relaxed);
+		}
+
+		for (int q = 0; q < 3; q++) {
+			double value = NAN;
+			uint64_t rank = (uint64_t)std::ceil(quantiles[q] * count), seen = 0;
+			for (int i = 0; count && i < uS::LatencyHistogram::BUCKETS; i++) {
+				seen += counts[i];
+				if (seen >= rank) {
+					value = uS::LatencyHistogram::highestValue(i) / 1e9;
+					break;
+				}
+			}
+			snprintf(line, sizeof(line), "relay_stage_latency_seconds{stage=\"%s\",quantile=\"%s\"} %.9g\n", LatencyStageNames[stage], quantileNames[q], value);
+			text += line;
+		}
+		snprintf(line, sizeof(line), "relay_stage_latency_seconds_sum{stage=\"%s\"} %.9g\nrelay_stage_latency_seconds_count{stage=\"%s\"} %llu\n",
+			LatencyStageNames[stage], total / 1e9, LatencyStageNames[stage], (unsigned long long)count);
+		text += line;
+	}
+}
+
+// Starts or stops recording latency on every Hub thread
+void SetLatencyEnabled(bool enabled) {
+	for (int i = 0; i < RelayThreadCount; i++) {
+		RelayThreads[i]->latency.enabled.store(enabled, std::memory_order_relaxed);
+	}
+}
+
+// Writes every RelayMetric summed over all Hub threads in Prometheus text format
+std::string RenderMetrics() {
+	std::string text;
+	char line[256];
+	for (size_t i = 0; i < sizeof(RelayMetrics) / sizeof(RelayMetric); i++) {
+		const RelayMetric &metric = RelayMetrics[i];
+		if (metric.help) {
+			snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n", metric.name, metric.help, metric.name, metric.type);
+			text += line;
+		}
+		unsigned long long value = SumRelayCounter(metric.counter);
+		if (metric.labels) {
+			snprintf(line, sizeof(line), "%s{%s} %llu\n", metric.name, metric.labels, value);
+		}
+		else {
+			snprintf(line, sizeof(line), "%s %llu\n", metric.name, value);
+		}
+		text += line;
+	}
+	RenderLatency(text);
+	return text;
+}
+
+// Updates the sampled gauges of self (METRICS_SAMPLE_MS timer)
+void SampleGauges(RelayThread* self) {
+	uint64_t queuedBytes = 0;
+	self->slots.forEach([&](Session* v) {
+		queuedBytes += v->webSocket->getBufferedAmount();
+	});
+	self->counters.sessions.store(self->slots.population.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	self->counters.queuedBytes.store(queuedBytes, std::memory_order_relaxed);
+	self->counters.retiredObjects.store(self->retired.size(), std::memory_order_relaxed);
+
+	uS::MemoryPool* pool = self->hub->getMemoryPool();
+	self->counters.poolHits.store(pool->hits, std::memory_order_relaxed);
+	self->counters.poolMisses.store(pool->misses, std::memory_order_relaxed);
+	self->counters.poolRetainedBytes.store(pool->retainedBytes, std::memory_order_relaxed);
+
+	uS::ZeroCopyStats* zeroCopy = self->hub->getZeroCopyStats();
+	self->counters.zeroCopiedBytes.store(zeroCopy->zeroCopiedBytes, std::memory_order_relaxed);
+	self->counters.zeroCopyCopiedBytes.store(zeroCopy->copiedBytes, std::memory_order_relaxed);
+	self->counters.zeroCopyAbandonedBytes.store(zeroCopy->abandonedBytes, std::memory_order_relaxed);
+}
+
+// SSL info callback of the TLS context of each Hub thread
+void CountTlsHandshakes(const SSL* ssl, int where, int ret) {
+	if (where & SSL_CB_HANDSHAKE_DONE) {
+		AddRelayCounter(LocalThread->counters.tlsHandshakes, 1);
+#ifdef UWS_KTLS
+		// OpenSSL installs the keys it can while the handshake finishes, anything else stays in userspace
+		if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+			AddRelayCounter(LocalThread->counters.tlsKernelSend, 1);
+		}
+		if (BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+			AddRelayCounter(LocalThread->counters.tlsKernelReceive, 1);
+		}
+#endif
+	}
+}
+
+// Serves METRICS_PATH and the LATENCY_*_PATH toggles on METRICS_HOST:METRICS_PORT from the loop of self
+void ListenMetrics(RelayThread* self) {
+	uWS::Group<uWS::SERVER>* metrics = self->hub->createGroup<uWS::SERVER>();
+	metrics->onHttpRequest([](uWS::HttpResponse* res, uWS::HttpRequest req, char* data, size_t length, size_t remainingBytes) {
+		uWS::Header url = req.getUrl();
+		std::string path(url.value, url.valueLength);
+		std::string text;
+		if (req.getMethod() != uWS::HttpMethod::METHOD_GET) {
+			path.clear();
+		}
+
+		if (path == METRICS_PATH) {
+			text = RenderMetrics();
+		}
+		else if (path == LATENCY_ENABLE_PATH || path == LATENCY_DISABLE_PATH) {
+			SetLatencyEnabled(path == LATENCY_ENABLE_PATH);
+			text = path == LATENCY_ENABLE_PATH ? "latency enabled\n" : "latency disabled\n";
+		}
+		else {
+			static const char notFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+			res->write(notFound, sizeof(notFound) - 1);
+			res->end();
+			return;
+		}
+		char head[128];
+		int headLength = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", text.length());
+		res->write(head, headLength);
+		res->end(text.data(), text.length());
+	});
+	metrics->onError([](int port) {
+		printf("Failed to listen on metrics port %i!\n", port);
+	});
+	self->hub->listen(METRICS_HOST, METRICS_PORT, nullptr, 0, metrics);
+}
+
+
 /////////////////////
 // MAIN FUNCTION
 /////////////////
 int main(int argc, char* argv[])
 {
+	RelayThreadCount = std::min<int>(std::max<int>(std::thread::hardware_concurrency(), 1), MAX_RELAY_THREADS);
+	for (int i = 0; i < RelayThreadCount; i++) {
+		RelayThreads[i] = new RelayThread(i);
+	}
+
 	//
-	// Create special relay channel: re_globl 
+	// Create special relay channel: re_globl (after RelayThreadCount, channels keep members per thread)
 	//
 	{
-		auto globalAdd = ChannelClientTable.insert(std::make_pair("re_globl", tbb::concurrent_unordered_set<Session*>()));
-		reGlobalChannelIndex = &(globalAdd.first->second);
+		reGlobalChannel = Channels.acquire();
+		reGlobalChannel->key = ChannelKey("re_globl", 8);
+		reGlobalChannel->listed = true;
+		ChannelDirectory.insert(std::make_pair(reGlobalChannel->key, reGlobalChannel->id));
+		for (auto &listeners : Listeners) {
+			listeners.members = new ChannelMembers[RelayThreadCount];
+		}
 	}
 
-	std::vector<std::thread *> threads(std::thread::hardware_concurrency());
+	std::vector<std::thread *> threads(RelayThreadCount);
 	
-	for (auto &thread : threads) {
-		thread = new std::thread([] {
-			uWS::Hub h;
+	for (int i = 0; i < RelayThreadCount; i++) {
+		threads[i] = new std::thread([](RelayThread* self) {
+			uWS::Hub h(0, false, SERVER_MAX_MESSAGE);
+
+			// Pin this thread's sessions to its Hub and receive deliveries from other threads
+			LocalThread = self;
+			self->hub = &h;
+			self->async = new uS::Async(h.getLoop());
+			self->async->setData(self);
+			self->async->start(DrainMailbox);
+
+			// Keep freed message memory for the next fan-out instead of returning it to malloc
+			uS::MemoryPool* pool = h.getMemoryPool();
+			for (int c = 0; c < uS::MemoryPool::CLASSES; c++) {
+				pool->setDepth(c, uS::MemoryPool::blockSize(c) <= uS::MemoryPool::SMALL_MAX ? POOL_SMALL_DEPTH : POOL_LARGE_DEPTH);
+			}
+			pool->retainLimit = POOL_RETAIN_LIMIT;
+
+			// Come online after every wakeup, hand deliveries for other threads over and go offline before blocking again
+			h.getLoop()->preCbData = self;
+			h.getLoop()->preCb = [](void* data) {
+				((RelayThread*)data)->loopTime = SteadyNanoseconds();
+				EnterEpoch((RelayThread*)data);
+			};
+			h.getLoop()->postCbData = self;
+			h.getLoop()->postCb = [](void* data) {
+				CloseSlowConsumers((RelayThread*)data);
+				FlushVariableChanges((RelayThread*)data);
+				FlushOutboxes((RelayThread*)data);
+				// Deferred writes run message callbacks and may end sockets, send them while still online
+				((RelayThread*)data)->hub->getLoop()->flush();
+				LeaveEpoch((RelayThread*)data);
+			};
+
+			// Wake up periodically so retired objects get freed on idle threads too
+			self->reclaimTimer = new uS::Timer(h.getLoop());
+			self->reclaimTimer->start([](uS::Timer*) {}, RECLAIM_INTERVAL_MS, RECLAIM_INTERVAL_MS);
+
+			self->sampleTimer = new uS::Timer(h.getLoop());
+			self->sampleTimer->setData(self);
+			self->sampleTimer->start([](uS::Timer* timer) {
+				SampleGauges((RelayThread*)timer->getData());
+			}, METRICS_SAMPLE_MS, METRICS_SAMPLE_MS);
+
+			h.onConnection([](uWS::WebSocket<uWS::SERVER> *ws, uWS::HttpRequest req) {
+				AddRelayCounter(LocalThread->counters.connections, 1);
+			});
 
 			h.onMessage([](uWS::WebSocket<uWS::SERVER> *ws, char *message, size_t length, uWS::OpCode code) {
 				Session* client = (Session*)ws->getUserData();
 
-				// Wait for garbage collection and get lock
-				AcquireGarbageLock gcLock = AcquireGarbageLock();
+				RelayCounters &counters = LocalThread->counters;
+				if (code == uWS::OpCode::TEXT) {
+					AddRelayCounter(counters.textIn, 1);
+					AddRelayCounter(counters.textBytesIn, length);
+				}
+				else {
+					AddRelayCounter(counters.binaryIn, 1);
+					AddRelayCounter(counters.binaryBytesIn, length);
+				}
 
 				// client is not NULL, meaning this socket has a Session
 				if (client) {
@@ -645,87 +2335,61 @@ int main(int argc, char* argv[])
 				}
 				// FIRST PACKET: client is NULL, meaning this socket needs a Session
 				else {
-					if (length > 16) {
+					if (length > CHANNEL_NAME_LENGTH) {
 						// Disconnect user if channel name is over 16 characters
 						DisconnectClient(NULL, ws, CLOSE_PROTOCOL_ERROR, MSG_CHANNEL_LENGTH_EXCEEDED, sizeof(MSG_CHANNEL_LENGTH_EXCEEDED));
 						return;
 					}
-					std::string channelName;
-					channelName.assign(message, length);
+					ChannelKey channelKey(message, length);
 
-					client = new Session(ws);
+					client = new Session(ws, LocalThread);
 					ws->send((const char*)&(client->userId), sizeof(client->userId), uWS::OpCode::BINARY);
 
-					auto node = ChannelClientTable.find(channelName);
-					if (node == ChannelClientTable.end()) {
-						// Create channel if it doesnt exist
-						auto insert = ChannelClientTable.insert(std::make_pair(channelName, tbb::concurrent_unordered_set<Session*>()));
-						if (insert.second == true) {
-							node = insert.first;
-						}
-					}
-					// Save channel value references
-					client->channelName = &node->first;
-					client->channelIndex = &node->second;
-					client->channelIndex->insert(client); // Add user to channel index
-					SessionExists.insert(client);         // Add user to global session list
+					JoinChannel(client, channelKey);
+					AddRelayCounter(counters.joins, 1);
 				}
 			});
 
 			h.onDisconnection([](uWS::WebSocket<uWS::SERVER>* ws, int code, char *message, size_t length) {
-				// Wait for garbage collection and get lock
-				AcquireGarbageLock gcLock = AcquireGarbageLock();
-
+				AddRelayCounter(LocalThread->counters.disconnections, 1);
 				Session* client = (Session*)ws->getUserData();
 				if (client) {
-					uint64_t dcMsgBuf[2];
-					dcMsgBuf[0] = RE_BROADCAST_TARGET; // Disconnection events come from the UserID: RE_BROADCAST_TARGET
-					dcMsgBuf[1] = (uint64_t)(client->userId);
-
-					if (client->valid) {
-						// If client is still valid: invalidate session
-						client->valid = false;
-						GarbageQueue.push(client);
-					}
-
-					// Send disconnect event to clients in the same channel
-					for (auto &v : *client->channelIndex) {
-						if (!(ws == (v->webSocket)) && v->valid) {
-							(v->webSocket)->send((const char*)(&dcMsgBuf[0]), 16, uWS::OpCode::BINARY);
-						}
-					}
-
-					// Send to disconnect events to users in 're_globl' channel with DisconnectMessage flag set in listenerMode 
-					for (auto &v : *reGlobalChannelIndex) {
-						if (!(ws == (v->webSocket)) && v->valid) {
-							if (v->listenerMode & DisconnectMessage) {
-								(v->webSocket)->send((const char*)(&dcMsgBuf[0]), 16, uWS::OpCode::BINARY);
-							}
-						}
-					}
+					// Client is still valid: invalidate session (sends the disconnect event)
+					RetireSession(client);
 				}
 
 			});
 
 			h.onError([](void *user) {
-				// Wait for garbage collection and get lock
-				AcquireGarbageLock gcLock = AcquireGarbageLock();
-
 				Session* client = (Session*)user;
-				if (client && client->valid) {
-					client->valid = false;
-					GarbageQueue.push(client);
+				if (client) {
+					RetireSession(client);
 				}
 			});
 
 			auto TlsContext = uS::TLS::createContext(SERVER_TLS_CERTIFICATE, SERVER_TLS_PRIVATEKEY, SERVER_TLS_KEYPASSWORD);
+			if (TlsContext) {
+				SSL_CTX_set_info_callback(TlsContext.getNativeContext(), CountTlsHandshakes);
+				if (SERVER_TLS_KERNEL && !TlsContext.enableKernelTls()) {
+					printf("Kernel TLS is not available in this OpenSSL build!\n");
+				}
+			}
 			if (!h.listen(SERVER_PORT, TlsContext, uS::ListenOptions::REUSE_PORT)) {
 				printf("Failed to listen on port %i!\n", SERVER_PORT);
 			}
+			if (METRICS_PORT && self->index == 0) {
+				ListenMetrics(self);
+			}
 
-			//h.getDefaultGroup<uWS::SERVER>().startAutoPing(15000); // 15sec WebSocket Ping
+			h.getDefaultGroup<uWS::SERVER>().setBackpressure(BACKPRESSURE_HIGH_WATERMARK, BACKPRESSURE_LOW_WATERMARK);
+			h.getDefaultGroup<uWS::SERVER>().setLatency(&self->latency);
+			h.getDefaultGroup<uWS::SERVER>().setZeroCopy(ZEROCOPY_THRESHOLD);
+			self->latency.enabled = LATENCY_AT_STARTUP;
+			if (AUTOPING_INTERVAL_MS) {
+				h.getDefaultGroup<uWS::SERVER>().startAutoPing(AUTOPING_INTERVAL_MS);
+			}
 			h.run();
-		});
+		}, RelayThreads[i]);
 
 		// Stagger thread creation to avoid OpenSSL crash:
 		// Crash occurs if creating more threads than physical cores
@@ -733,14 +2397,6 @@ int main(int argc, char* argv[])
 	}
 
 
-	std::thread gc([] {
-		std::chrono::seconds THIRTY_SECONDS = std::chrono::seconds(30);
-		for (;;) {
-			std::this_thread::sleep_for(THIRTY_SECONDS);
-			FreeGarbage();
-		}
-	});
-
 	for (auto &thread : threads) {
 		thread->join();
 	}
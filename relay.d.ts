@@ -22,6 +22,7 @@ export declare const Base64ToUInt8UserID: (userId: string) => Uint8Array;
 export type BinaryMessageHandler = (sender: Uint8Array, message: Uint8Array) => void;
 export type TextMessageHandler = (sender: Uint8Array, message: GenericObject) => void;
 export type VariableCallback = (message: Uint8Array) => void;
+export type VariableWatchCallback = (key: string, value: Uint8Array) => void;
 export type MessageHandlerCallback = (userId: Uint8Array, message: Uint8Array | GenericObject) => void;
 
 export declare class Relay {
@@ -31,6 +32,7 @@ export declare class Relay {
   public BinaryMessageHandlers: { [key: number]: BinaryMessageHandler };
   public TextMessageHandlers: { [key: number]: TextMessageHandler };
   public VariableCallbacks: VariableCallback[];
+  public VariableWatchers: { key: string, prefix: boolean, callback: VariableWatchCallback }[];
   public channelName: string;
   public ready: boolean;
   public userId: Uint8Array;
@@ -44,4 +46,6 @@ export declare class Relay {
   public tSendTo(target: UserTarget, obj: GenericObject): void;
   public SetChannelVar(key: string, value: string | Uint8Array): void;
   public GetChannelVar(key: string, callback: (message: Uint8Array) => void): void;
+  public WatchChannelVar(key: string, callback: VariableWatchCallback, prefix?: boolean): void;
+  public UnwatchChannelVar(key: string, prefix?: boolean): void;
 }
@@ -71,6 +71,7 @@ class Relay {
 		this.BinaryMessageHandlers = {};
 		this.TextMessageHandlers   = {};
 		this.VariableCallbacks     = []; // List of callback for variable requests
+		this.VariableWatchers      = []; // Watched keys or prefixes: { key, prefix, callback }
 
 		// Setup Properties
 		this.channelName = channelName;
@@ -82,6 +83,17 @@ class Relay {
 			let callback = this.VariableCallbacks.shift();
 			callback(msgValue);
         });
+
+		// Variable change notification: [8-byte version][1-byte key length][key][value]
+		this.SetMessageHandler(re.BINARY, 204, (userId, msg)=>{
+			let note  = new Uint8Array(msg);
+			let key   = re.ArrayToStr(note.subarray(9, 9 + note[8]));
+			let value = note.subarray(9 + note[8]);
+			for (let watcher of this.VariableWatchers) {
+				if (watcher.prefix ? key.startsWith(watcher.key) : key === watcher.key)
+					watcher.callback(key, value);
+			}
+		});
 	}
 
 	JoinChannel(e) {
@@ -223,6 +235,21 @@ class Relay {
 		this.VariableCallbacks.push(callback);
 		this.bSendTo(re.RELAY_QUERY, 5, msg);
 	}
+
+	// Calls callback(key, value) whenever the relay reports key (or with prefix set, any key starting with it) changed
+	WatchChannelVar(key, callback, prefix = false) {
+		let keyarr = Array.from(key).map(x=>x.charCodeAt());
+		let msg = Uint8Array.from([prefix ? 1 : 0].concat(keyarr));
+		this.VariableWatchers.push({ key: key, prefix: prefix, callback: callback });
+		this.bSendTo(re.RELAY_QUERY, 11, msg);
+	}
+
+	UnwatchChannelVar(key, prefix = false) {
+		let keyarr = Array.from(key).map(x=>x.charCodeAt());
+		let msg = Uint8Array.from([prefix ? 1 : 0].concat(keyarr));
+		this.VariableWatchers = this.VariableWatchers.filter(x=>x.key !== key || x.prefix !== prefix);
+		this.bSendTo(re.RELAY_QUERY, 12, msg);
+	}
 }
 
 
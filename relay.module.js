@@ -65,6 +65,7 @@ export class Relay {
 		this.BinaryMessageHandlers = {};
 		this.TextMessageHandlers   = {};
 		this.VariableCallbacks     = []; // List of callback for variable requests
+		this.VariableWatchers      = []; // Watched keys or prefixes: { key, prefix, callback }
 
 		// Setup Properties
 		this.channelName = channelName;
@@ -76,6 +77,19 @@ export class Relay {
 			let callback = this.VariableCallbacks.shift();
 			callback(msgValue);
 		});
+
+		// Variable change notification: [8-byte version][1-byte key length][key][value]
+		this.SetMessageHandler(BINARY_TYPE, 204, (userId, msg)=>{
+			const note  = new Uint8Array(msg);
+			const key   = ArrayToStr(note.subarray(9, 9 + note[8]));
+			const value = note.subarray(9 + note[8]);
+
+			for (const watcher of this.VariableWatchers) {
+				if (watcher.prefix ? key.startsWith(watcher.key) : key === watcher.key) {
+					watcher.callback(key, value);
+				}
+			}
+		});
 	}
 
 	JoinChannel() {
@@ -230,4 +244,21 @@ export class Relay {
 		this.VariableCallbacks.push(callback);
 		this.bSendTo(RELAY_QUERY, 5, msg);
 	}
+
+	// Calls callback(key, value) whenever the relay reports key (or with prefix set, any key starting with it) changed
+	WatchChannelVar(key, callback, prefix = false) {
+		const keyarr = Array.from(key).map(x=>x.charCodeAt());
+		const msg = Uint8Array.from([prefix ? 1 : 0].concat(keyarr));
+
+		this.VariableWatchers.push({ key, prefix, callback });
+		this.#bSendTo(QUERY, 11, msg);
+	}
+
+	UnwatchChannelVar(key, prefix = false) {
+		const keyarr = Array.from(key).map(x=>x.charCodeAt());
+		const msg = Uint8Array.from([prefix ? 1 : 0].concat(keyarr));
+
+		this.VariableWatchers = this.VariableWatchers.filter(x=>x.key !== key || x.prefix !== prefix);
+		this.#bSendTo(QUERY, 12, msg);
+	}
 };
@@ -23,7 +23,8 @@ void Loop::doEpoll(int epollTimeout) {
     closing.clear();
 
     int numFdReady = epoll_wait(epfd, readyEvents, 1024, epollTimeout);
-    timepoint = std::chrono::system_clock::now();
+    timers.now = TimerWheel::clock();
+    iterating = true;
 
     if (preCb) {
         preCb(preCbData);
@@ -35,41 +36,30 @@ void Loop::doEpoll(int epollTimeout) {
         callbacks[poll->state.cbIndex](poll, status, readyEvents[i].events);
     }
 
-    if (timers.size()) {
-        if (timers[0].timepoint < timepoint) {
-            do {
-                Timer *timer = timers[0].timer;
-                processingTimer = timer; // processing this timer
-                cancelledLastTimer = false;
-                timers[0].cb(timers[0].timer);
-
-                if (cancelledLastTimer) {
-                    continue;
-                }
-
-                int repeat = timers[0].nextDelay;
-                auto cb = timers[0].cb;
-                timers.erase(timers.begin());
-                if (repeat) {
-                    timer->start(cb, repeat, repeat);
-                }
-            } while (timers.size() && timers[0].timepoint < timepoint);
-
-        } else { // we have a timer but it did not process, so update our next delay
-            delay = std::max<int>(std::chrono::duration_cast<std::chrono::milliseconds>(timers[0].timepoint - timepoint).count(), 0);
-        }
-    }
+    timers.expire();
 
     if (postCb) {
         postCb(postCbData);
     }
+
+    // deferred writes go out last so that whatever postCb sent is included
+    flush();
+    iterating = false;
+}
+
+void Loop::flush() {
+    // flushing can complete messages whose callbacks write again (and append)
+    for (size_t i = 0; i < flushing.size(); i++) {
+        flushing[i].second(flushing[i].first);
+    }
+    flushing.clear();
 }
 
 void Loop::run() {
     // updated for consistency with libuv impl. behaviour
-    timepoint = std::chrono::system_clock::now();
+    timers.now = TimerWheel::clock();
     while (numPolls) {
-        doEpoll(delay);
+        doEpoll(timers.timeUntilNext());
     }
 }
 
@@ -78,7 +68,7 @@ void Loop::poll() {
         doEpoll(0);
     } else {
         // updated for consistency with libuv impl. behaviour
-        timepoint = std::chrono::system_clock::now();
+        timers.now = TimerWheel::clock();
     }
 }
 
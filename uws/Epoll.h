@@ -5,11 +5,12 @@
 #include <sys/eventfd.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <chrono>
 #include <algorithm>
 #include <vector>
 #include <mutex>
 
+#include "TimerWheel.h"
+
 typedef int uv_os_sock_t;
 static const int UV_READABLE = EPOLLIN;
 static const int UV_WRITABLE = EPOLLOUT;
@@ -23,31 +24,21 @@ extern std::recursive_mutex cbMutex;
 extern void (*callbacks[16])(Poll *, int, int);
 extern int cbHead;
 
-struct Timepoint {
-    void (*cb)(Timer *);
-    Timer *timer;
-    std::chrono::system_clock::time_point timepoint;
-    int nextDelay;
-};
-
 struct Loop {
     int epfd;
     int numPolls = 0;
-    bool cancelledLastTimer;
-    Timer *processingTimer = nullptr; // the timer we're currently processing a callback for
-    int delay = -1;  // delay to next timer expiry, or -1 if no timers pending
     epoll_event readyEvents[1024];
-    std::chrono::system_clock::time_point timepoint;
-    std::vector<Timepoint> timers;
+    TimerWheel timers; // Timers and the timeouts of sockets, its clock is read after every epoll_wait
     std::vector<std::pair<Poll *, void (*)(Poll *)>> closing;
+    std::vector<std::pair<Poll *, void (*)(Poll *)>> flushing; // sockets with writes deferred to the end of this iteration
+    bool iterating = false; // from epoll_wait returning until flushing is done, writes may be deferred meanwhile
 
     void (*preCb)(void *) = nullptr;
     void (*postCb)(void *) = nullptr;
     void *preCbData, *postCbData;
 
-    Loop(bool defaultLoop) {
+    Loop(bool defaultLoop) : timers(TimerWheel::clock()) {
         epfd = epoll_create1(EPOLL_CLOEXEC);
-        timepoint = std::chrono::system_clock::now();
     }
 
     static Loop *createLoop(bool defaultLoop = true) {
@@ -61,6 +52,9 @@ struct Loop {
 
     void doEpoll(int epollTimeout);
 
+    // sends the writes deferred so far, postCb may call it to finish them before it returns
+    void flush();
+
     void run();
 
     void poll();
@@ -73,27 +67,27 @@ struct Loop {
 struct Timer {
     Loop *loop;
     void *data;
+    void (*cb)(Timer *);
+    int repeat;
+    Timeout timeout;
 
     Timer(Loop *loop) {
         this->loop = loop;
     }
 
     void start(void (*cb)(Timer *), int timeout, int repeat) {
-        loop->timepoint = std::chrono::system_clock::now();
-        std::chrono::system_clock::time_point timepoint = loop->timepoint + std::chrono::milliseconds(timeout);
-
-        Timepoint t = {cb, this, timepoint, repeat};
-        loop->timers.insert(
-            std::upper_bound(loop->timers.begin(), loop->timers.end(), t, [](const Timepoint &a, const Timepoint &b) {
-                return a.timepoint < b.timepoint;
-            }),
-            t
-        );
-
-        loop->delay = -1;
-        if (loop->timers.size()) {
-            loop->delay = std::max<int>(std::chrono::duration_cast<std::chrono::milliseconds>(loop->timers[0].timepoint - loop->timepoint).count(), 0);
-        }
+        this->cb = cb;
+        this->repeat = repeat;
+        this->timeout.data = this;
+        this->timeout.cb = [](Timeout *timeout) {
+            Timer *timer = (Timer *) timeout->data;
+            // rescheduled first, the callback may stop or close the timer
+            if (timer->repeat) {
+                timer->loop->timers.add(&timer->timeout, timer->repeat);
+            }
+            timer->cb(timer);
+        };
+        loop->timers.add(&this->timeout, timeout);
     }
 
     void setData(void *data) {
@@ -106,26 +100,11 @@ struct Timer {
 
     // always called before destructor
     void stop() {
-        auto pos = loop->timers.begin();
-        for (Timepoint &t : loop->timers) {
-            if (t.timer == this) {
-                loop->timers.erase(pos);
-                break;
-            }
-            pos++;
-        }
-
-        if(loop->processingTimer == this) {
-            loop->cancelledLastTimer = true;
-        }
-
-        loop->delay = -1;
-        if (loop->timers.size()) {
-            loop->delay = std::max<int>(std::chrono::duration_cast<std::chrono::milliseconds>(loop->timers[0].timepoint - loop->timepoint).count(), 0);
-        }
+        timeout.cancel();
     }
 
     void close() {
+        timeout.cancel();
         delete this;
     }
 };
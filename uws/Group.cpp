@@ -14,30 +14,63 @@ void *Group<isServer>::getUserData() {
 }
 
 template <bool isServer>
-void Group<isServer>::timerCallback(uS::Timer *timer) {
-    Group<isServer> *group = (Group<isServer> *) timer->getData();
+void Group<isServer>::onPingTimeout(uS::Socket *s) {
+    WebSocket<isServer> *webSocket = static_cast<WebSocket<isServer> *>(s);
+    Group<isServer> *group = Group<isServer>::from(webSocket);
 
-    group->forEach([](uWS::WebSocket<isServer> *webSocket) {
-        if (webSocket->hasOutstandingPong) {
-            webSocket->terminate();
-        } else {
-            webSocket->hasOutstandingPong = true;
-        }
-    });
+    if (webSocket->hasOutstandingPong) {
+        webSocket->terminate();
+        return;
+    }
 
+    // rearmed first, a failing send ends the socket and cancels it
+    webSocket->hasOutstandingPong = true;
+    webSocket->template startTimeout<onPingTimeout>(group->pingIntervalMs);
     if (group->userPingMessage.length()) {
-        group->broadcast(group->userPingMessage.data(), group->userPingMessage.length(), OpCode::TEXT);
+        webSocket->send(group->userPingMessage.data(), group->userPingMessage.length(), OpCode::TEXT);
     } else {
-        group->broadcast(nullptr, 0, OpCode::PING);
+        webSocket->send(nullptr, 0, OpCode::PING);
+    }
+}
+
+template <bool isServer>
+void Group<isServer>::onHttpIdleTimeout(uS::Socket *s) {
+    HttpSocket<isServer> *httpSocket = static_cast<HttpSocket<isServer> *>(s);
+
+    if (httpSocket->missedDeadline) {
+        httpSocket->terminate();
+        return;
+    }
+
+    if (!httpSocket->outstandingResponsesHead) {
+        httpSocket->missedDeadline = true;
     }
+    httpSocket->template startTimeout<onHttpIdleTimeout>(HTTP_IDLE_CHECK_MS);
 }
 
 template <bool isServer>
 void Group<isServer>::startAutoPing(int intervalMs, std::string userMessage) {
-    timer = new uS::Timer(loop);
-    timer->setData(this);
-    timer->start(timerCallback, intervalMs, intervalMs);
+    pingIntervalMs = intervalMs;
     userPingMessage = userMessage;
+    forEach([intervalMs](WebSocket<isServer> *webSocket) {
+        webSocket->template startTimeout<onPingTimeout>(intervalMs);
+    });
+}
+
+template <bool isServer>
+void Group<isServer>::setBackpressure(size_t highWatermark, size_t lowWatermark) {
+    this->highWatermark = highWatermark;
+    this->lowWatermark = lowWatermark < highWatermark ? lowWatermark : highWatermark;
+}
+
+template <bool isServer>
+void Group<isServer>::setZeroCopy(size_t threshold) {
+    zeroCopyThreshold = threshold;
+}
+
+template <bool isServer>
+void Group<isServer>::setLatency(uS::Latency *latency) {
+    this->latency = latency;
 }
 
 template <bool isServer>
@@ -47,22 +80,10 @@ void Group<isServer>::addHttpSocket(HttpSocket<isServer> *httpSocket) {
         httpSocket->next = httpSocketHead;
     } else {
         httpSocket->next = nullptr;
-        // start timer
-        httpTimer = new uS::Timer(hub->getLoop());
-        httpTimer->setData(this);
-        httpTimer->start([](uS::Timer *httpTimer) {
-            Group<isServer> *group = (Group<isServer> *) httpTimer->getData();
-            group->forEachHttpSocket([](HttpSocket<isServer> *httpSocket) {
-                if (httpSocket->missedDeadline) {
-                    httpSocket->terminate();
-                } else if (!httpSocket->outstandingResponsesHead) {
-                    httpSocket->missedDeadline = true;
-                }
-            });
-        }, 1000, 1000);
     }
     httpSocketHead = httpSocket;
     httpSocket->prev = nullptr;
+    httpSocket->template startTimeout<onHttpIdleTimeout>(HTTP_IDLE_CHECK_MS);
 }
 
 template <bool isServer>
@@ -70,10 +91,9 @@ void Group<isServer>::removeHttpSocket(HttpSocket<isServer> *httpSocket) {
     if (iterators.size()) {
         iterators.top() = httpSocket->next;
     }
+    httpSocket->cancelTimeout();
     if (httpSocket->prev == httpSocket->next) {
         httpSocketHead = nullptr;
-        httpTimer->stop();
-        httpTimer->close();
     } else {
         if (httpSocket->prev) {
             ((HttpSocket<isServer> *) httpSocket->prev)->next = httpSocket->next;
@@ -96,6 +116,9 @@ void Group<isServer>::addWebSocket(WebSocket<isServer> *webSocket) {
     }
     webSocketHead = webSocket;
     webSocket->prev = nullptr;
+    if (pingIntervalMs) {
+        webSocket->template startTimeout<onPingTimeout>(pingIntervalMs);
+    }
 }
 
 template <bool isServer>
@@ -103,6 +126,7 @@ void Group<isServer>::removeWebSocket(WebSocket<isServer> *webSocket) {
     if (iterators.size()) {
         iterators.top() = webSocket->next;
     }
+    webSocket->cancelTimeout();
     if (webSocket->prev == webSocket->next) {
         webSocketHead = nullptr;
     } else {
@@ -257,10 +281,7 @@ void Group<isServer>::close(int code, char *message, size_t length) {
     forEachHttpSocket([](HttpSocket<isServer> *httpSocket) {
         httpSocket->shutdown();
     });
-    if (timer) {
-        timer->stop();
-        timer->close();
-    }
+    pingIntervalMs = 0;
 }
 
 template struct Group<true>;
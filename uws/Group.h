@@ -42,13 +42,17 @@ protected:
     unsigned int maxPayload;
     Hub *hub;
     int extensionOptions;
-    uS::Timer *timer = nullptr, *httpTimer = nullptr;
+    int pingIntervalMs = 0;
     std::string userPingMessage;
     std::stack<uS::Poll *> iterators;
 
     // todo: cannot be named user, collides with parent!
     void *userData = nullptr;
-    static void timerCallback(uS::Timer *timer);
+
+    // sockets time out on their own (Socket::startTimeout), nothing walks the lists
+    static const int HTTP_IDLE_CHECK_MS = 1000;
+    static void onPingTimeout(uS::Socket *s);
+    static void onHttpIdleTimeout(uS::Socket *s);
 
     WebSocket<isServer> *webSocketHead = nullptr;
     HttpSocket<isServer> *httpSocketHead = nullptr;
@@ -86,8 +90,24 @@ public:
     // Not thread safe
     void terminate();
     void close(int code = 1000, char *message = nullptr, size_t length = 0);
+
+    // pings every WebSocket of this group intervalMs after it joined or last pinged, terminating those
+    // that sent nothing since the last ping. each socket keeps its own phase, so pings are spread out
     void startAutoPing(int intervalMs, std::string userMessage = "");
 
+    // WebSockets of this group report isBackpressured() once their queue reaches
+    // highWatermark bytes, until it drains to lowWatermark. 0 disables
+    void setBackpressure(size_t highWatermark, size_t lowWatermark);
+
+    // plaintext sockets of this group send shared payloads (WebSocket::sendPrepared) of at least
+    // threshold bytes with MSG_ZEROCOPY, keeping them until the kernel reports it is done with
+    // them. Linux with the epoll loop only, 0 disables. see Hub::getZeroCopyStats
+    void setZeroCopy(size_t threshold);
+
+    // sockets of this group record their stages in latency while it is enabled,
+    // it must belong to the thread of this group
+    void setLatency(uS::Latency *latency);
+
     // same as listen(TRANSFERS), backwards compatible API for now
     void addAsync() {
         if (!async) {
@@ -289,7 +289,7 @@ void HttpSocket<isServer>::onEnd(uS::Socket *s) {
         if (message->callback) {
             message->callback(nullptr, message->callbackData, true, nullptr);
         }
-        httpSocket->messageQueue.pop();
+        httpSocket->freeMessage(httpSocket->messageQueue.pop());
     }
 
     while (httpSocket->outstandingResponsesHead) {
@@ -105,9 +105,12 @@ struct HttpRequest {
 
 struct HttpResponse;
 
+template <bool isServer>
+struct Group;
+
 template <const bool isServer>
 struct WIN32_EXPORT HttpSocket : uS::Socket {
-    void *httpUser; // remove this later, setTimeout occupies user for now
+    void *httpUser; // remove this later, user used to be occupied by startTimeout
     HttpResponse *outstandingResponsesHead = nullptr;
     HttpResponse *outstandingResponsesTail = nullptr;
     HttpResponse *preAllocatedResponse = nullptr;
@@ -130,6 +133,7 @@ protected:
     friend struct uS::Socket;
     friend struct HttpResponse;
     friend struct Hub;
+    friend struct Group<isServer>;
     static uS::Socket *onData(uS::Socket *s, char *data, size_t length);
     static void onEnd(uS::Socket *s);
 };
@@ -208,7 +208,6 @@ void Hub::connect(std::string uri, void *user, std::map<std::string, std::string
     } else {
         HttpSocket<CLIENT> *httpSocket = (HttpSocket<CLIENT> *) uS::Node::connect<allocateHttpSocket, onClientConnection>(hostname.c_str(), port, secure, eh);
         if (httpSocket) {
-            // startTimeout occupies the user
             httpSocket->startTimeout<HttpSocket<CLIENT>::onEnd>(timeoutMs);
             httpSocket->httpUser = user;
 
@@ -75,6 +75,8 @@ public:
     using uS::Node::run;
     using uS::Node::poll;
     using uS::Node::getLoop;
+    using uS::Node::getMemoryPool;
+    using uS::Node::getZeroCopyStats;
     using Group<SERVER>::onConnection;
     using Group<CLIENT>::onConnection;
     using Group<SERVER>::onTransfer;
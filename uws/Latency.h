@@ -0,0 +1,95 @@
+#ifndef LATENCY_UWS_H
+#define LATENCY_UWS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace uS {
+
+// log-linear histogram of nanosecond durations (HdrHistogram style): every power of two
+// is split into 2^SUB_BUCKET_BITS linear sub buckets, so values keep ~3% precision.
+// written by one thread, read by any
+struct LatencyHistogram {
+    static const int SUB_BUCKET_BITS = 5;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_BITS = 40; // ~18 minutes, longer durations are clamped
+    static const int BUCKETS = (MAX_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    std::atomic<uint64_t> counts[BUCKETS];
+    std::atomic<uint64_t> total{0}; // sum of all recorded values
+
+    LatencyHistogram() {
+        for (std::atomic<uint64_t> &count : counts) {
+            count.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    static int index(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return (int) value;
+        }
+        if (value >> MAX_BITS) {
+            return BUCKETS - 1;
+        }
+#ifdef _MSC_VER
+        unsigned long exponent;
+        _BitScanReverse64(&exponent, value);
+#else
+        int exponent = 63 - __builtin_clzll(value);
+#endif
+        return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + (int) ((value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+    }
+
+    // highest value that falls in bucket i
+    static uint64_t highestValue(int i) {
+        if (i < SUB_BUCKETS) {
+            return i;
+        }
+        int shift = (i >> SUB_BUCKET_BITS) - 1;
+        return ((uint64_t) (SUB_BUCKETS | (i & (SUB_BUCKETS - 1))) << shift) + ((uint64_t) 1 << shift) - 1;
+    }
+
+    void record(uint64_t value) {
+        std::atomic<uint64_t> &count = counts[index(value)];
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total.store(total.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+};
+
+// stages of a message through the loop, see Latency
+enum LatencyStage {
+    LATENCY_READ,    // recv / SSL_read call
+    LATENCY_PARSE,   // end of the read, or of the previous handler of that read, until the message handler is called (framing, unmasking, inflate, utf-8)
+    LATENCY_HANDLER, // message handler
+    LATENCY_FANOUT,  // recorded by the application, the relay records its broadcasts
+    LATENCY_QUEUE,   // message queued on a socket until completely written
+    LATENCY_STAGES
+};
+
+// per thread stage histograms, set with Group::setLatency. Recording only happens while
+// enabled, which may be toggled from any thread
+struct Latency {
+    std::atomic<bool> enabled{false};
+    LatencyHistogram stages[LATENCY_STAGES];
+    uint64_t readTime = 0; // end of the last read of this thread, moved to the end of each handler it called
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void record(LatencyStage stage, uint64_t nanoseconds) {
+        stages[stage].record(nanoseconds);
+    }
+};
+
+}
+
+#endif // LATENCY_UWS_H
@@ -0,0 +1,143 @@
+#ifndef MEMORYPOOL_UWS_H
+#define MEMORYPOOL_UWS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace uS {
+
+// free lists of the memory messages are queued in (Socket::allocMessage), one pool per Node used by its
+// thread only. blocks up to SMALL_MAX bytes come in 16 byte classes, larger ones up to LARGE_MAX in powers
+// of two, anything larger goes straight to the heap. a class keeps at most its depth of freed blocks and
+// the pool at most retainLimit bytes, the rest is deleted. blocks are plain heap memory, so a block
+// allocated by one pool may be freed to another (sockets transferred between threads)
+struct MemoryPool {
+    static const int SMALL_SHIFT = 4;
+    static const size_t SMALL_MAX = 1024;
+    static const int SMALL_CLASSES = (int) (SMALL_MAX >> SMALL_SHIFT);
+    static const int LARGE_MIN_SHIFT = 11, LARGE_MAX_SHIFT = 16;
+    static const size_t LARGE_MAX = (size_t) 1 << LARGE_MAX_SHIFT;
+    static const int CLASSES = SMALL_CLASSES + LARGE_MAX_SHIFT - LARGE_MIN_SHIFT + 1;
+    static const int UNPOOLED = -1; // class of blocks larger than LARGE_MAX
+
+    static const unsigned int DEFAULT_SMALL_DEPTH = 256, DEFAULT_LARGE_DEPTH = 8;
+    static const size_t DEFAULT_RETAIN_LIMIT = 4 * 1024 * 1024;
+
+    // written by the owning thread, sample them there
+    uint64_t hits = 0;          // allocations served from a free list
+    uint64_t misses = 0;        // allocations that went to the heap, unpooled ones included
+    uint64_t retainedBytes = 0; // bytes held in the free lists
+    size_t retainLimit = DEFAULT_RETAIN_LIMIT;
+
+    // class of blocks that hold length bytes
+    static int sizeClass(size_t length) {
+        if (length <= SMALL_MAX) {
+            return length ? (int) ((length - 1) >> SMALL_SHIFT) : 0;
+        }
+        if (length > LARGE_MAX) {
+            return UNPOOLED;
+        }
+        int shift = LARGE_MIN_SHIFT;
+        while (((size_t) 1 << shift) < length) {
+            shift++;
+        }
+        return SMALL_CLASSES + shift - LARGE_MIN_SHIFT;
+    }
+
+    static size_t blockSize(int sizeClass) {
+        if (sizeClass < SMALL_CLASSES) {
+            return (size_t) (sizeClass + 1) << SMALL_SHIFT;
+        }
+        return (size_t) 1 << (sizeClass - SMALL_CLASSES + LARGE_MIN_SHIFT);
+    }
+
+    MemoryPool() {
+        for (int i = 0; i < CLASSES; i++) {
+            lists[i].depth = i < SMALL_CLASSES ? DEFAULT_SMALL_DEPTH : DEFAULT_LARGE_DEPTH;
+        }
+    }
+
+    MemoryPool(const MemoryPool &) = delete;
+    MemoryPool &operator=(const MemoryPool &) = delete;
+
+    ~MemoryPool() {
+        for (int i = 0; i < CLASSES; i++) {
+            trim(i, 0);
+        }
+    }
+
+    // at least length bytes, pass sizeClass back to free
+    char *allocate(size_t length, int &sizeClass) {
+        sizeClass = MemoryPool::sizeClass(length);
+        if (sizeClass == UNPOOLED) {
+            misses++;
+            return new char[length];
+        }
+
+        FreeList &list = lists[sizeClass];
+        if (list.head) {
+            Block *block = list.head;
+            list.head = block->next;
+            list.count--;
+            retainedBytes -= blockSize(sizeClass);
+            hits++;
+            return (char *) block;
+        }
+        misses++;
+        return new char[blockSize(sizeClass)];
+    }
+
+    void free(char *memory, int sizeClass) {
+        if (sizeClass == UNPOOLED) {
+            delete [] memory;
+            return;
+        }
+
+        FreeList &list = lists[sizeClass];
+        size_t size = blockSize(sizeClass);
+        if (list.count < list.depth && retainedBytes + size <= retainLimit) {
+            Block *block = (Block *) memory;
+            block->next = list.head;
+            list.head = block;
+            list.count++;
+            retainedBytes += size;
+        } else {
+            delete [] memory;
+        }
+    }
+
+    // freed blocks kept for sizeClass, extra ones are deleted right away
+    void setDepth(int sizeClass, unsigned int depth) {
+        lists[sizeClass].depth = depth;
+        trim(sizeClass, depth);
+    }
+
+    unsigned int getDepth(int sizeClass) {
+        return lists[sizeClass].depth;
+    }
+
+private:
+    struct Block {
+        Block *next;
+    };
+
+    struct FreeList {
+        Block *head = nullptr;
+        unsigned int count = 0, depth = 0;
+    } lists[CLASSES];
+
+    void trim(int sizeClass, unsigned int depth) {
+        FreeList &list = lists[sizeClass];
+        while (list.count > depth) {
+            Block *block = list.head;
+            list.head = block->next;
+            list.count--;
+            retainedBytes -= blockSize(sizeClass);
+            delete [] (char *) block;
+        }
+    }
+};
+
+}
+
+#endif // MEMORYPOOL_UWS_H
@@ -56,6 +56,16 @@ Context createContext(std::string certChainFileName, std::string keyFileName, st
     return context;
 }
 
+bool Context::enableKernelTls()
+{
+#ifdef UWS_KTLS
+    SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+    return true;
+#else
+    return false;
+#endif
+}
+
 }
 
 #ifndef _WIN32
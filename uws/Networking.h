@@ -55,6 +55,7 @@ inline SOCKET dup(SOCKET socket) {
 }
 #else
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
@@ -67,6 +68,9 @@ inline SOCKET dup(SOCKET socket) {
 #endif
 
 #include "Backend.h"
+#include "Latency.h"
+#include "MemoryPool.h"
+#include "TimerWheel.h"
 #include <openssl/ssl.h>
 #include <csignal>
 #include <vector>
@@ -75,6 +79,17 @@ inline SOCKET dup(SOCKET socket) {
 #include <algorithm>
 #include <memory>
 
+// MSG_ZEROCOPY sends (Socket::zeroCopies) need the epoll loop, which hands their completions to ioHandler
+#if defined(USE_EPOLL) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define UWS_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+// kernel TLS (TLS::Context::enableKernelTls) needs OpenSSL 3 built with it
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define UWS_KTLS
+#endif
+
 namespace uS {
 
 // todo: mark sockets nonblocking in these functions
@@ -187,6 +202,12 @@ public:
     SSL_CTX *getNativeContext() {
         return context;
     }
+
+    // once a handshake completes, OpenSSL hands the keys of the connection to the kernel (TCP_ULP "tls")
+    // where the kernel and cipher support it, else it keeps encrypting itself. sockets whose records the
+    // kernel both seals and opens read and write plaintext from then on (Socket::kernelTls).
+    // false if OpenSSL was built without it
+    bool enableKernelTls();
 };
 
 Context WIN32_EXPORT createContext(std::string certChainFileName, std::string keyFileName, std::string keyFilePassword = std::string());
@@ -195,6 +216,13 @@ Context WIN32_EXPORT createContext(std::string certChainFileName, std::string ke
 
 struct Socket;
 
+// bytes of MSG_ZEROCOPY sends by how they completed, written by the loop thread
+struct ZeroCopyStats {
+    uint64_t zeroCopiedBytes = 0; // sent from the pinned payload itself
+    uint64_t copiedBytes = 0;     // copied after all: by the kernel (loopback, no scatter-gather) or when it was out of option memory
+    uint64_t abandonedBytes = 0;  // of sockets closed meanwhile that the kernel never reported done, their messages are leaked
+};
+
 // NodeData is like a Context, maybe merge them?
 struct WIN32_EXPORT NodeData {
     char *recvBufferMemoryBlock;
@@ -203,40 +231,30 @@ struct WIN32_EXPORT NodeData {
     Loop *loop;
     uS::Context *netContext;
     void *user = nullptr;
-    static const int preAllocMaxSize = 1024;
-    char **preAlloc;
+    MemoryPool *memoryPool; // Queue::Message memory of this loop
     SSL_CTX *clientContext;
 
     Async *async = nullptr;
     pthread_t tid;
 
+    // Socket::isBackpressured, bytes queued per socket (0 disables)
+    size_t highWatermark = 0, lowWatermark = 0;
+
+    // shared payloads this large are sent with MSG_ZEROCOPY on plaintext sockets (0 disables)
+    size_t zeroCopyThreshold = 0;
+    ZeroCopyStats *zeroCopyStats;
+
+    // stage histograms of this loop, nullptr disables
+    Latency *latency = nullptr;
+
+    // per-socket timeouts (Socket::startTimeout) of this loop, the Timers of the loop itself with epoll
+    TimerWheel *timeouts;
+
     std::recursive_mutex *asyncMutex;
     std::vector<Poll *> transferQueue;
     std::vector<Poll *> changePollQueue;
     static void asyncCallback(Async *async);
 
-    static int getMemoryBlockIndex(size_t length) {
-        return (int) ((length >> 4) + bool(length & 15));
-    }
-
-    char *getSmallMemoryBlock(int index) {
-        if (preAlloc[index]) {
-            char *memory = preAlloc[index];
-            preAlloc[index] = nullptr;
-            return memory;
-        } else {
-            return new char[index << 4];
-        }
-    }
-
-    void freeSmallMemoryBlock(char *memory, int index) {
-        if (!preAlloc[index]) {
-            preAlloc[index] = memory;
-        } else {
-            delete [] memory;
-        }
-    }
-
 public:
     void addAsync() {
         async = new Async(loop);
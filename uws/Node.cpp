@@ -49,14 +49,25 @@ Node::Node(int recvLength, int prePadding, int postPadding, bool useDefaultLoop)
     nodeData->loop = loop;
     nodeData->asyncMutex = &asyncMutex;
 
-    int indices = NodeData::getMemoryBlockIndex(NodeData::preAllocMaxSize) + 1;
-    nodeData->preAlloc = new char*[indices];
-    for (int i = 0; i < indices; i++) {
-        nodeData->preAlloc[i] = nullptr;
-    }
+    nodeData->memoryPool = new MemoryPool;
+    nodeData->zeroCopyStats = new ZeroCopyStats;
 
     nodeData->clientContext = SSL_CTX_new(SSLv23_client_method());
     SSL_CTX_set_options(nodeData->clientContext, SSL_OP_NO_SSLv3);
+
+#ifdef USE_EPOLL
+    nodeData->timeouts = &loop->timers;
+#else
+    // other backends have timers of their own, one of them drives the wheel
+    nodeData->timeouts = new TimerWheel(TimerWheel::clock());
+    timeoutTimer = new Timer(loop);
+    timeoutTimer->setData(nodeData->timeouts);
+    timeoutTimer->start([](Timer *timer) {
+        TimerWheel *timeouts = (TimerWheel *) timer->getData();
+        timeouts->now = TimerWheel::clock();
+        timeouts->expire();
+    }, TIMEOUT_TICK_MS, TIMEOUT_TICK_MS);
+#endif
 }
 
 void Node::run() {
@@ -69,16 +80,15 @@ void Node::poll() {
 }
 
 Node::~Node() {
+#ifndef USE_EPOLL
+    timeoutTimer->stop();
+    timeoutTimer->close();
+    delete nodeData->timeouts;
+#endif
     delete [] nodeData->recvBufferMemoryBlock;
     SSL_CTX_free(nodeData->clientContext);
-
-    int indices = NodeData::getMemoryBlockIndex(NodeData::preAllocMaxSize) + 1;
-    for (int i = 0; i < indices; i++) {
-        if (nodeData->preAlloc[i]) {
-            delete [] nodeData->preAlloc[i];
-        }
-    }
-    delete [] nodeData->preAlloc;
+    delete nodeData->memoryPool;
+    delete nodeData->zeroCopyStats;
     delete nodeData->netContext;
     delete nodeData;
     loop->destroy();
@@ -75,6 +75,12 @@ protected:
     NodeData *nodeData;
     std::recursive_mutex asyncMutex;
 
+#ifndef USE_EPOLL
+    // socket timeouts are this coarse without epoll
+    static const int TIMEOUT_TICK_MS = 100;
+    Timer *timeoutTimer;
+#endif
+
 public:
     Node(int recvLength = 1024, int prePadding = 0, int postPadding = 0, bool useDefaultLoop = false);
     ~Node();
@@ -89,6 +95,16 @@ public:
         return loop;
     }
 
+    // free lists of this thread's queued messages, configure and sample them from this thread
+    MemoryPool *getMemoryPool() {
+        return nodeData->memoryPool;
+    }
+
+    // how the MSG_ZEROCOPY sends of this thread completed (Group::setZeroCopy), sample them from this thread
+    ZeroCopyStats *getZeroCopyStats() {
+        return nodeData->zeroCopyStats;
+    }
+
     template <uS::Socket *I(Socket *s), void C(Socket *p, bool error)>
     Socket *connect(const char *hostname, int port, bool secure, NodeData *nodeData) {
         Context *netContext = nodeData->netContext;
@@ -0,0 +1,379 @@
+#include "Simd.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define UWS_SIMD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define UWS_TARGET(isa)
+#else
+#include <cpuid.h>
+#define UWS_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace uWS {
+
+namespace Simd {
+
+static void unmaskScalar(char *dst, const char *src, const char *mask, size_t length) {
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    uint64_t mask64 = ((uint64_t) mask32 << 32) | mask32;
+
+    // every word is loaded before it is stored, which keeps dst <= src overlaps intact
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, 8);
+        word ^= mask64;
+        memcpy(dst + i, &word, 8);
+    }
+    for (; i < length; i += 4) {
+        uint32_t word;
+        memcpy(&word, src + i, 4);
+        word ^= mask32;
+        memcpy(dst + i, &word, 4);
+    }
+}
+
+// Based on utf8_check.c by Markus Kuhn, 2005
+// https://www.cl.cam.ac.uk/~mgk25/ucs/utf8_check.c
+// Optimized for predominantly 7-bit content by Alex Hultman, 2016
+// Licensed as Zlib, like the rest of this project
+static bool isValidUtf8Scalar(const unsigned char *s, size_t length)
+{
+    for (const unsigned char *e = s + length; s != e; ) {
+        if (s + 4 <= e && ((*(uint32_t *) s) & 0x80808080) == 0) {
+            s += 4;
+        } else {
+            while (!(*s & 0x80)) {
+                if (++s == e) {
+                    return true;
+                }
+            }
+
+            if ((s[0] & 0x60) == 0x40) {
+                if (s + 1 >= e || (s[1] & 0xc0) != 0x80 || (s[0] & 0xfe) == 0xc0) {
+                    return false;
+                }
+                s += 2;
+            } else if ((s[0] & 0xf0) == 0xe0) {
+                if (s + 2 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
+                        (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) || (s[0] == 0xed && (s[1] & 0xe0) == 0xa0)) {
+                    return false;
+                }
+                s += 3;
+            } else if ((s[0] & 0xf8) == 0xf0) {
+                if (s + 3 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80 ||
+                        (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) || (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) {
+                    return false;
+                }
+                s += 4;
+            } else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+#ifdef UWS_SIMD_X86
+
+// utf-8 by lookup (Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte", 2021):
+// the high nibble of a byte, its low nibble and the high nibble of the byte after it each look up
+// which errors they allow, an error is flagged where all three agree. the lookup misses
+// only the length errors of 3 and 4-byte sequences, which come from the bytes 2 and 3 back
+static const char TOO_SHORT = 1 << 0;       // lead or ascii byte followed by a continuation
+static const char TOO_LONG = 1 << 1;        // ascii byte followed by a continuation
+static const char OVERLONG_3 = 1 << 2;      // 11100000 100_____
+static const char TOO_LARGE = 1 << 3;       // 11110100 1001____ and above
+static const char SURROGATE = 1 << 4;       // 11101101 101_____
+static const char OVERLONG_2 = 1 << 5;      // 1100000_ 10______
+static const char TOO_LARGE_1000 = 1 << 6;  // 11110101 1000____ and above
+static const char OVERLONG_4 = 1 << 6;      // 11110000 1000____
+static const char TWO_CONTS = (char) 0x80;  // continuation followed by a continuation, unless 2 or 3 back was a lead
+static const char CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS;
+
+#define UTF8_BYTE_1_HIGH \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define UTF8_BYTE_1_LOW \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define UTF8_BYTE_2_HIGH \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+// sse4
+
+UWS_TARGET("sse4.1")
+static void unmaskSse4(char *dst, const char *src, const char *mask, size_t length) {
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    __m128i mask128 = _mm_set1_epi32((int) mask32);
+
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        __m128i first = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i second = _mm_loadu_si128((const __m128i *) (src + i + 16));
+        __m128i third = _mm_loadu_si128((const __m128i *) (src + i + 32));
+        __m128i fourth = _mm_loadu_si128((const __m128i *) (src + i + 48));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(first, mask128));
+        _mm_storeu_si128((__m128i *) (dst + i + 16), _mm_xor_si128(second, mask128));
+        _mm_storeu_si128((__m128i *) (dst + i + 32), _mm_xor_si128(third, mask128));
+        _mm_storeu_si128((__m128i *) (dst + i + 48), _mm_xor_si128(fourth, mask128));
+    }
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(block, mask128));
+    }
+    unmaskScalar(dst + i, src + i, mask, length - i);
+}
+
+// errors of input given the block before it
+UWS_TARGET("sse4.1")
+static inline __m128i utf8ErrorsSse4(__m128i input, __m128i previous) {
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i prev1 = _mm_alignr_epi8(input, previous, 15);
+    __m128i byte1High = _mm_shuffle_epi8(_mm_setr_epi8(UTF8_BYTE_1_HIGH), _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+    __m128i byte1Low = _mm_shuffle_epi8(_mm_setr_epi8(UTF8_BYTE_1_LOW), _mm_and_si128(prev1, nibble));
+    __m128i byte2High = _mm_shuffle_epi8(_mm_setr_epi8(UTF8_BYTE_2_HIGH), _mm_and_si128(_mm_srli_epi16(input, 4), nibble));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+    // continuations 2 and 3 bytes after 3 and 4-byte leads have bit 7 set by TWO_CONTS, clear it
+    __m128i third = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 14), _mm_set1_epi8((char) (0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(_mm_alignr_epi8(input, previous, 13), _mm_set1_epi8((char) (0xF0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char) 0x80));
+    return _mm_xor_si128(must23, special);
+}
+
+UWS_TARGET("sse4.1")
+static bool isValidUtf8Sse4(const unsigned char *s, size_t length) {
+    // non-zero where the last 3 bytes start a sequence longer than what is left of the block
+    const __m128i incompleteAbove = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                  (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+    __m128i error = _mm_setzero_si128(), previous = _mm_setzero_si128(), incomplete = _mm_setzero_si128();
+
+    alignas(16) unsigned char tail[16];
+    for (size_t i = 0; i < length; i += 16) {
+        __m128i input;
+        if (i + 16 <= length) {
+            input = _mm_loadu_si128((const __m128i *) (s + i));
+        } else {
+            // ascii zeros behind the end, so sequences cut by it are too short
+            memset(tail, 0, 16);
+            memcpy(tail, s + i, length - i);
+            input = _mm_load_si128((const __m128i *) tail);
+        }
+
+        if (_mm_movemask_epi8(input)) {
+            error = _mm_or_si128(error, utf8ErrorsSse4(input, previous));
+            incomplete = _mm_subs_epu8(input, incompleteAbove);
+        } else {
+            error = _mm_or_si128(error, incomplete);
+        }
+        previous = input;
+    }
+    error = _mm_or_si128(error, incomplete);
+    return _mm_testz_si128(error, error);
+}
+
+// avx2
+
+UWS_TARGET("avx2")
+static void unmaskAvx2(char *dst, const char *src, const char *mask, size_t length) {
+    uint32_t mask32;
+    memcpy(&mask32, mask, 4);
+    __m256i mask256 = _mm256_set1_epi32((int) mask32);
+
+    size_t i = 0;
+    for (; i + 128 <= length; i += 128) {
+        __m256i first = _mm256_loadu_si256((const __m256i *) (src + i));
+        __m256i second = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+        __m256i third = _mm256_loadu_si256((const __m256i *) (src + i + 64));
+        __m256i fourth = _mm256_loadu_si256((const __m256i *) (src + i + 96));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(first, mask256));
+        _mm256_storeu_si256((__m256i *) (dst + i + 32), _mm256_xor_si256(second, mask256));
+        _mm256_storeu_si256((__m256i *) (dst + i + 64), _mm256_xor_si256(third, mask256));
+        _mm256_storeu_si256((__m256i *) (dst + i + 96), _mm256_xor_si256(fourth, mask256));
+    }
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_xor_si256(block, mask256));
+    }
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(block, _mm256_castsi256_si128(mask256)));
+    }
+    unmaskScalar(dst + i, src + i, mask, length - i);
+}
+
+// bytes of input shifted n places towards its end, the last n of previous shifted in
+#define PREVIOUS_AVX2(input, previous, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - n)
+
+UWS_TARGET("avx2")
+static inline __m256i utf8ErrorsAvx2(__m256i input, __m256i previous) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i prev1 = PREVIOUS_AVX2(input, previous, 1);
+    __m256i byte1High = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_setr_epi8(UTF8_BYTE_1_HIGH)), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte1Low = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_setr_epi8(UTF8_BYTE_1_LOW)), _mm256_and_si256(prev1, nibble));
+    __m256i byte2High = _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_setr_epi8(UTF8_BYTE_2_HIGH)), _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    __m256i third = _mm256_subs_epu8(PREVIOUS_AVX2(input, previous, 2), _mm256_set1_epi8((char) (0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(PREVIOUS_AVX2(input, previous, 3), _mm256_set1_epi8((char) (0xF0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+    return _mm256_xor_si256(must23, special);
+}
+
+UWS_TARGET("avx2")
+static bool isValidUtf8Avx2(const unsigned char *s, size_t length) {
+    // a padded 32-byte tail costs more than it saves on short messages
+    if (length < 64) {
+        return isValidUtf8Sse4(s, length);
+    }
+
+    const __m256i incompleteAbove = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                     -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                     (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+    __m256i error = _mm256_setzero_si256(), previous = _mm256_setzero_si256(), incomplete = _mm256_setzero_si256();
+
+    alignas(32) unsigned char tail[32];
+    for (size_t i = 0; i < length; i += 32) {
+        __m256i input;
+        if (i + 32 <= length) {
+            input = _mm256_loadu_si256((const __m256i *) (s + i));
+        } else {
+            memset(tail, 0, 32);
+            memcpy(tail, s + i, length - i);
+            input = _mm256_load_si256((const __m256i *) tail);
+        }
+
+        if (_mm256_movemask_epi8(input)) {
+            error = _mm256_or_si256(error, utf8ErrorsAvx2(input, previous));
+            incomplete = _mm256_subs_epu8(input, incompleteAbove);
+        } else {
+            error = _mm256_or_si256(error, incomplete);
+        }
+        previous = input;
+    }
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error);
+}
+
+static void cpuid(int leaf, int info[4]) {
+#ifdef _MSC_VER
+    __cpuidex(info, leaf, 0);
+#else
+    unsigned int a, b, c, d;
+    __cpuid_count(leaf, 0, a, b, c, d);
+    info[0] = (int) a, info[1] = (int) b, info[2] = (int) c, info[3] = (int) d;
+#endif
+}
+
+// registers the os saves on context switches
+static uint64_t xgetbv() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned int eax, edx;
+    __asm__ volatile("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return ((uint64_t) edx << 32) | eax;
+#endif
+}
+
+#endif
+
+static Level detect() {
+#ifdef UWS_SIMD_X86
+    int info[4];
+    cpuid(0, info);
+    int leaves = info[0];
+
+    cpuid(1, info);
+    bool ssse3 = info[2] & (1 << 9), sse41 = info[2] & (1 << 19);
+    bool osxsave = info[2] & (1 << 27), avx = info[2] & (1 << 28);
+
+    bool avx2 = false;
+    if (leaves >= 7 && osxsave && avx && (xgetbv() & 6) == 6) {
+        cpuid(7, info);
+        avx2 = info[1] & (1 << 5);
+    }
+    return avx2 ? AVX2 : ((ssse3 && sse41) ? SSE4 : SCALAR);
+#else
+    return SCALAR;
+#endif
+}
+
+void (*unmask)(char *dst, const char *src, const char *mask, size_t length) = unmaskScalar;
+bool (*isValidUtf8)(const unsigned char *s, size_t length) = isValidUtf8Scalar;
+
+static Level current = SCALAR;
+static Level detected = detect();
+static Level startup = select(detected);
+
+Level level() {
+    return current;
+}
+
+Level supported() {
+    return detected;
+}
+
+Level select(Level level) {
+    current = level < detected ? level : detected;
+    switch (current) {
+#ifdef UWS_SIMD_X86
+    case AVX2:
+        unmask = unmaskAvx2;
+        isValidUtf8 = isValidUtf8Avx2;
+        break;
+    case SSE4:
+        unmask = unmaskSse4;
+        isValidUtf8 = isValidUtf8Sse4;
+        break;
+#endif
+    default:
+        unmask = unmaskScalar;
+        isValidUtf8 = isValidUtf8Scalar;
+        break;
+    }
+    return current;
+}
+
+const char *levelName(Level level) {
+    static const char *names[] = {"scalar", "sse4", "avx2"};
+    return names[level];
+}
+
+}
+
+}
@@ -0,0 +1,40 @@
+#ifndef SIMD_UWS_H
+#define SIMD_UWS_H
+
+#include <cstddef>
+
+namespace uWS {
+
+// websocket kernels in scalar, SSE4 and AVX2 versions. the widest one the cpu supports is
+// picked at startup (cpuid), so one binary runs on every x86-64 without -march=native
+namespace Simd {
+
+enum Level {
+    SCALAR,
+    SSE4,
+    AVX2
+};
+
+// level in use
+Level level();
+
+// widest level of this cpu
+Level supported();
+
+// uses the given level, capped at supported(), returns the level in use
+Level select(Level level);
+
+const char *levelName(Level level);
+
+// xors length bytes of src (rounded up to a multiple of 4) with the repeating 4-byte mask
+// into dst. dst may overlap src as long as it does not start after it
+extern void (*unmask)(char *dst, const char *src, const char *mask, size_t length);
+
+// strict utf-8 validation (no overlongs, surrogates or code points above U+10FFFF)
+extern bool (*isValidUtf8)(const unsigned char *s, size_t length);
+
+}
+
+}
+
+#endif // SIMD_UWS_H
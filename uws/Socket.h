@@ -3,8 +3,26 @@
 
 #include "Networking.h"
 
+#include <atomic>
+#include <deque>
+
 namespace uS {
 
+// bytes queued on any number of sockets, of any loop, without copying them (Socket::sendShared).
+// every queued message holds a reference, the last one released destroys the payload
+struct SharedPayload {
+    char *buffer;
+    size_t length;
+    std::atomic<int> references;
+    void (*destroy)(SharedPayload *payload);
+
+    void release() {
+        if (!--references) {
+            destroy(this);
+        }
+    }
+};
+
 struct TransferData {
     // Connection state
     uv_os_sock_t fd;
@@ -22,39 +40,74 @@ struct TransferData {
     void (*transferCb)(Poll *);
 };
 
-// perfectly 64 bytes (4 + 60)
+// Poll and state share the first 8 bytes, the timeout, message queue and list links take it past one
+// cache line: 120 bytes with epoll on 64-bit, checked below so new members don't spill into a third line
 struct WIN32_EXPORT Socket : Poll {
 protected:
     struct {
         int poll : 4;
         int shuttingDown : 4;
-    } state = {0, false};
+        int deferWrites : 2;  // writes made while the loop iterates are flushed at its end (epoll only)
+        int flushQueued : 2;  // listed in Loop::flushing
+        int backpressured : 2; // queue went past NodeData::highWatermark and not yet below lowWatermark
+        int sslRetry : 2;      // SSL_write of the head message failed and has to be repeated with the same buffer
+        int kernelTls : 2;     // the kernel took over the TLS records, see kernelTls()
+    } state = {0, false, false, false, false, false, false};
 
     SSL *ssl;
     void *user = nullptr;
     NodeData *nodeData;
+    Timeout timeout; // startTimeout, one at a time
 
     // this is not needed by HttpSocket!
     struct Queue {
         struct Message {
-            const char *data;
+            const char *data; // unsent bytes of the message itself, stored right behind it
             size_t length;
             Message *nextMessage = nullptr;
             void (*callback)(void *socket, void *data, bool cancelled, void *reserved) = nullptr;
             void *callbackData = nullptr, *reserved = nullptr;
+            uint64_t queuedAt = 0; // Latency::now() when queued, 0 unless latency was enabled
+            int sizeClass; // of its memory in NodeData::memoryPool, see Socket::freeMessage
+            SharedPayload *payload; // sent after data, referenced until the message is freed
+            size_t payloadSent;
+
+            // unsent bytes, own and shared
+            size_t size() {
+                return length + (payload ? payload->length - payloadSent : 0);
+            }
+
+            // first unsent segment, own bytes go before the payload
+            size_t segment(const char *&segmentData) {
+                if (length || !payload) {
+                    segmentData = data;
+                    return length;
+                }
+                segmentData = payload->buffer + payloadSent;
+                return payload->length - payloadSent;
+            }
+
+            // skips sent bytes, own ones first
+            void consume(size_t sent) {
+                size_t own = std::min(sent, length);
+                data += own;
+                length -= own;
+                payloadSent += sent - own;
+            }
         };
 
         Message *head = nullptr, *tail = nullptr;
-        void pop()
+        size_t bytes = 0; // unsent bytes of all messages
+
+        // unlinks the head, which the caller frees (Socket::freeMessage)
+        Message *pop()
         {
-            Message *nextMessage;
-            if ((nextMessage = head->nextMessage)) {
-                delete [] (char *) head;
-                head = nextMessage;
-            } else {
-                delete [] (char *) head;
-                head = tail = nullptr;
+            bytes -= head->size();
+            Message *message = head;
+            if (!(head = head->nextMessage)) {
+                tail = nullptr;
             }
+            return message;
         }
 
         bool empty() {return head == nullptr;}
@@ -62,6 +115,7 @@ protected:
 
         void push(Message *message)
         {
+            bytes += message->size();
             message->nextMessage = nullptr;
             if (tail) {
                 tail->nextMessage = message;
@@ -73,6 +127,32 @@ protected:
         }
     } messageQueue;
 
+#ifdef UWS_ZEROCOPY
+    // MSG_ZEROCOPY sends whose completion the error queue has not reported yet, oldest first.
+    // the kernel numbers the sends of a socket from 0 and may complete a range of them at once
+    struct ZeroCopy {
+        enum {PENDING, ZERO_COPIED, COPIED};
+        struct Send {
+            size_t bytes;
+            Queue::Message *message; // written completely by this send, freed once it completes
+            int state;
+        };
+        std::deque<Send> sends;
+        uint32_t firstId = 0; // of sends.front()
+        bool enabled;         // the socket took SO_ZEROCOPY
+
+        // once the socket closed with sends pending (orphanZeroCopy): its descriptor, kept open
+        // for the error queue, which reap reads every ZEROCOPY_REAP_MS until they completed
+        uv_os_sock_t fd;
+        NodeData *nodeData;
+        Timeout reap;
+        uint64_t orphanedAt;
+    } *zeroCopy = nullptr;    // allocated with the first message large enough
+
+    static const int ZEROCOPY_REAP_MS = 10;
+    static const int ZEROCOPY_ABANDON_MS = 60000; // orphans never completed by then leak their messages
+#endif
+
     int getPoll() {
         return state.poll;
     }
@@ -86,7 +166,56 @@ protected:
         state.shuttingDown = shuttingDown;
     }
 
+    // nodeData->latency while it is enabled
+    Latency *getLatency() {
+        Latency *latency = nodeData->latency;
+        return (latency && latency->isEnabled()) ? latency : nullptr;
+    }
+
+    // start of a read, 0 unless latency is enabled
+    uint64_t readStarted() {
+        return getLatency() ? Latency::now() : 0;
+    }
+
+    // records LATENCY_READ and when parsing starts, which stays unknown (0) after untimed reads
+    void readEnded(uint64_t readStart) {
+        Latency *latency = nodeData->latency;
+        if (latency) {
+            latency->readTime = readStart ? Latency::now() : 0;
+            if (readStart) {
+                latency->record(LATENCY_READ, latency->readTime - readStart);
+            }
+        }
+    }
+
+    // records the residency of a message that was completely written, now is read once per batch
+    void recordQueued(Queue::Message *message, uint64_t &now) {
+        if (message->queuedAt && nodeData->latency) {
+            if (!now) {
+                now = Latency::now();
+            }
+            nodeData->latency->record(LATENCY_QUEUE, now - message->queuedAt);
+        }
+    }
+
+    // hysteresis between the watermarks of nodeData, a zero highWatermark disables it
+    void updateBackpressure() {
+        if (state.backpressured) {
+            state.backpressured = messageQueue.bytes > nodeData->lowWatermark;
+        } else if (nodeData->highWatermark) {
+            state.backpressured = messageQueue.bytes >= nodeData->highWatermark;
+        }
+    }
+
     void transfer(NodeData *nodeData, void (*cb)(Poll *)) {
+        // timeouts belong to the wheel of this loop
+        cancelTimeout();
+
+        // deferred writes are left to the destination loop
+        if (!messageQueue.empty()) {
+            setPoll(getPoll() | UV_WRITABLE);
+        }
+
         // userData is invalid from now on till onTransfer
         setUserData(new TransferData({getFd(), ssl, getCb(), getPoll(), getUserData(), nodeData, cb}));
         stop(this->nodeData->loop);
@@ -118,27 +247,148 @@ protected:
         }
     }
 
-    // clears user data!
+    // replaces the running timeout, if any. not thread safe
     template <void onTimeout(Socket *)>
     void startTimeout(int timeoutMs = 15000) {
-        Timer *timer = new Timer(nodeData->loop);
-        timer->setData(this);
-        timer->start([](Timer *timer) {
-            Socket *s = (Socket *) timer->getData();
-            s->cancelTimeout();
-            onTimeout(s);
-        }, timeoutMs, 0);
-
-        user = timer;
+        timeout.data = this;
+        timeout.cb = [](Timeout *timeout) {
+            onTimeout((Socket *) timeout->data);
+        };
+        nodeData->timeouts->add(&timeout, timeoutMs);
     }
 
     void cancelTimeout() {
-        Timer *timer = (Timer *) getUserData();
-        if (timer) {
-            timer->stop();
-            timer->close();
-            user = nullptr;
+        timeout.cancel();
+    }
+
+    // SSL_write of what is left of message, a segment at a time. partial writes are off, so a segment
+    // is written whole or retried later from the same pointer. false if a segment failed, sent holds
+    // the result of that SSL_write
+    bool sslWrite(Queue::Message *message, int &sent) {
+        while (message->size()) {
+            const char *segment;
+            int segmentLength = (int) message->segment(segment);
+            sent = SSL_write(ssl, segment, segmentLength);
+            if (sent != segmentLength) {
+                state.sslRetry = true;
+                return false;
+            }
+            message->consume(sent);
+        }
+        state.sslRetry = false;
+        return true;
+    }
+
+    // whether the kernel seals and opens the TLS records of this socket (TLS::Context::enableKernelTls),
+    // which then reads and writes plaintext with ioHandler. decided once the handshake is done and
+    // OpenSSL holds nothing that is still to be read or written through it
+    bool kernelTls() {
+#ifdef UWS_KTLS
+        if (!state.kernelTls && ssl && SSL_is_init_finished(ssl) && !state.sslRetry && !SSL_has_pending(ssl)
+                && BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl))) {
+            state.kernelTls = true;
         }
+#endif
+        return state.kernelTls;
+    }
+
+    static const size_t TLS_RECORD_SIZE = 16384; // most plaintext one TLS record holds
+
+    // joins the head of the queue and the messages behind it into one message of up to a record of
+    // plaintext, so that one SSL_write makes one record of them rather than one record each. joining
+    // stops at the first message with a callback, which the joined message takes over
+    void coalesceHead() {
+        if (state.sslRetry) {
+            return;
+        }
+
+        Queue::Message *head = messageQueue.front();
+        size_t length = 0;
+        int count = 0;
+        for (Queue::Message *messagePtr = head; messagePtr && length + messagePtr->size() <= TLS_RECORD_SIZE; messagePtr = messagePtr->nextMessage) {
+            length += messagePtr->size();
+            count++;
+            if (messagePtr->callback) {
+                break;
+            }
+        }
+        if (count < 2) {
+            return;
+        }
+
+        Queue::Message *joined = allocMessage(length);
+        joined->queuedAt = head->queuedAt;
+        char *data = (char *) joined->data;
+        Queue::Message *messagePtr = head;
+        for (int i = 0; i < count; i++) {
+            memcpy(data, messagePtr->data, messagePtr->length);
+            data += messagePtr->length;
+            if (messagePtr->payload) {
+                size_t payloadLength = messagePtr->payload->length - messagePtr->payloadSent;
+                memcpy(data, messagePtr->payload->buffer + messagePtr->payloadSent, payloadLength);
+                data += payloadLength;
+            }
+            joined->callback = messagePtr->callback;
+            joined->callbackData = messagePtr->callbackData;
+            joined->reserved = messagePtr->reserved;
+
+            Queue::Message *nextMessage = messagePtr->nextMessage;
+            freeMessage(messagePtr);
+            messagePtr = nextMessage;
+        }
+
+        // same bytes, messageQueue.bytes holds
+        joined->nextMessage = messagePtr;
+        messageQueue.head = joined;
+        if (!messagePtr) {
+            messageQueue.tail = joined;
+        }
+    }
+
+    // SSL_writes queued messages, small ones coalesced into records, until the queue is empty or SSL
+    // has to wait. Returns false on SSL error
+    bool sslDrainQueue() {
+        cork(true);
+        uint64_t sentAt = 0;
+        bool failed = false;
+        while (true) {
+            coalesceHead();
+            Queue::Message *messagePtr = messageQueue.front();
+            size_t unsent = messagePtr->size();
+            int sent;
+            bool written = sslWrite(messagePtr, sent);
+            messageQueue.bytes -= unsent - messagePtr->size();
+            if (written) {
+                recordQueued(messagePtr, sentAt);
+                if (messagePtr->callback) {
+                    messagePtr->callback(this, messagePtr->callbackData, false, messagePtr->reserved);
+                }
+                freeMessage(messageQueue.pop());
+                updateBackpressure();
+                if (messageQueue.empty()) {
+                    if ((state.poll & UV_WRITABLE) && SSL_want(ssl) != SSL_WRITING) {
+                        change(nodeData->loop, this, setPoll(UV_READABLE));
+                    }
+                    break;
+                }
+            } else if (sent <= 0) {
+                switch (SSL_get_error(ssl, sent)) {
+                case SSL_ERROR_WANT_READ:
+                    break;
+                case SSL_ERROR_WANT_WRITE:
+                    if ((getPoll() & UV_WRITABLE) == 0) {
+                        change(nodeData->loop, this, setPoll(getPoll() | UV_WRITABLE));
+                    }
+                    break;
+                default:
+                    failed = true;
+                    break;
+                }
+                break;
+            }
+        }
+        cork(false);
+        return !failed;
     }
 
     template <class STATE>
@@ -151,43 +401,17 @@ protected:
         }
 
         if (!socket->messageQueue.empty() && ((events & UV_WRITABLE) || SSL_want(socket->ssl) == SSL_READING)) {
-            socket->cork(true);
-            while (true) {
-                Queue::Message *messagePtr = socket->messageQueue.front();
-                int sent = SSL_write(socket->ssl, messagePtr->data, (int) messagePtr->length);
-                if (sent == (ssize_t) messagePtr->length) {
-                    if (messagePtr->callback) {
-                        messagePtr->callback(p, messagePtr->callbackData, false, messagePtr->reserved);
-                    }
-                    socket->messageQueue.pop();
-                    if (socket->messageQueue.empty()) {
-                        if ((socket->state.poll & UV_WRITABLE) && SSL_want(socket->ssl) != SSL_WRITING) {
-                            socket->change(socket->nodeData->loop, socket, socket->setPoll(UV_READABLE));
-                        }
-                        break;
-                    }
-                } else if (sent <= 0) {
-                    switch (SSL_get_error(socket->ssl, sent)) {
-                    case SSL_ERROR_WANT_READ:
-                        break;
-                    case SSL_ERROR_WANT_WRITE:
-                        if ((socket->getPoll() & UV_WRITABLE) == 0) {
-                            socket->change(socket->nodeData->loop, socket, socket->setPoll(socket->getPoll() | UV_WRITABLE));
-                        }
-                        break;
-                    default:
-                        STATE::onEnd((Socket *) p);
-                        return;
-                    }
-                    break;
-                }
+            if (!socket->sslDrainQueue()) {
+                STATE::onEnd((Socket *) p);
+                return;
             }
-            socket->cork(false);
         }
 
         if (events & UV_READABLE) {
             do {
+                uint64_t readStart = socket->readStarted();
                 int length = SSL_read(socket->ssl, socket->nodeData->recvBuffer, socket->nodeData->recvLength);
+                socket->readEnded(readStart);
                 if (length <= 0) {
                     switch (SSL_get_error(socket->ssl, length)) {
                     case SSL_ERROR_WANT_READ:
@@ -211,8 +435,115 @@ protected:
                 }
             } while (SSL_pending(socket->ssl));
         }
+
+        // a socket that replaced this one (HttpSocket upgrade) made its own choice in setState
+        if (socket == p && socket->kernelTls()) {
+            socket->setCb(ioHandler<STATE>);
+        }
+    }
+
+#ifdef UWS_ZEROCOPY
+    // whether message is sent with MSG_ZEROCOPY, enabling it on the socket the first time.
+    // a message already partly sent that way stays zero-copy so that it is kept till completion.
+    // TLS sockets never are, kernel TLS does not take MSG_ZEROCOPY either
+    bool zeroCopies(Queue::Message *message) {
+        if (zeroCopy && !zeroCopy->sends.empty() && !zeroCopy->sends.back().message) {
+            return true;
+        }
+        if (ssl || !message->payload || !nodeData->zeroCopyThreshold || message->payload->length < nodeData->zeroCopyThreshold) {
+            return false;
+        }
+        if (!zeroCopy) {
+            int enable = 1;
+            zeroCopy = new ZeroCopy;
+            zeroCopy->enabled = !setsockopt(getFd(), SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable));
+        }
+        return zeroCopy->enabled;
+    }
+
+    // marks sends first to last (inclusive) completed, then frees what completed in order
+    static void completeZeroCopy(NodeData *nodeData, ZeroCopy *zeroCopy, uint32_t first, uint32_t last, bool copied) {
+        for (uint32_t id = first, count = last - first + 1; count; id++, count--) {
+            uint32_t index = id - zeroCopy->firstId;
+            if (index < zeroCopy->sends.size()) {
+                zeroCopy->sends[index].state = copied ? ZeroCopy::COPIED : ZeroCopy::ZERO_COPIED;
+            }
+        }
+
+        ZeroCopyStats *stats = nodeData->zeroCopyStats;
+        while (!zeroCopy->sends.empty() && zeroCopy->sends.front().state != ZeroCopy::PENDING) {
+            ZeroCopy::Send &send = zeroCopy->sends.front();
+            (send.state == ZeroCopy::COPIED ? stats->copiedBytes : stats->zeroCopiedBytes) += send.bytes;
+            if (send.message) {
+                freeMessage(nodeData, send.message);
+            }
+            zeroCopy->sends.pop_front();
+            zeroCopy->firstId++;
+        }
+    }
+
+    // reads the completions off the error queue of fd
+    static void readZeroCopy(NodeData *nodeData, ZeroCopy *zeroCopy, uv_os_sock_t fd) {
+        while (true) {
+            char control[128];
+            msghdr header = {};
+            header.msg_control = control;
+            header.msg_controllen = sizeof(control);
+            if (::recvmsg(fd, &header, MSG_ERRQUEUE) == SOCKET_ERROR) {
+                break;
+            }
+            for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+                sock_extended_err *error = (sock_extended_err *) CMSG_DATA(cmsg);
+                if (!error->ee_errno && error->ee_origin == SO_EE_ORIGIN_ZEROCOPY) {
+                    completeZeroCopy(nodeData, zeroCopy, error->ee_info, error->ee_data, error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+                }
+            }
+        }
     }
 
+    // reads the completions off the error queue, they raise EPOLLERR like actual errors do.
+    // false if the socket has an actual error
+    bool reapZeroCopy() {
+        readZeroCopy(nodeData, zeroCopy, getFd());
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        return !getsockopt(getFd(), SOL_SOCKET, SO_ERROR, &error, &length) && !error;
+    }
+
+    // takes over the pending sends of a closing socket and closes fd once they completed. completions are
+    // only reported while the descriptor is open, so the connection is reset without closing it (connect
+    // to AF_UNSPEC): the kernel drops what it still had to send and releases the pages it pinned
+    static void orphanZeroCopy(NodeData *nodeData, ZeroCopy *zeroCopy, uv_os_sock_t fd) {
+        sockaddr unspecified = {};
+        unspecified.sa_family = AF_UNSPEC;
+        ::connect(fd, &unspecified, sizeof(unspecified));
+
+        zeroCopy->fd = fd;
+        zeroCopy->nodeData = nodeData;
+        zeroCopy->orphanedAt = nodeData->timeouts->now;
+        zeroCopy->reap.data = zeroCopy;
+        zeroCopy->reap.cb = [](Timeout *timeout) {
+            ZeroCopy *zeroCopy = (ZeroCopy *) timeout->data;
+            NodeData *nodeData = zeroCopy->nodeData;
+            readZeroCopy(nodeData, zeroCopy, zeroCopy->fd);
+            if (!zeroCopy->sends.empty()) {
+                if (nodeData->timeouts->now - zeroCopy->orphanedAt < ZEROCOPY_ABANDON_MS) {
+                    nodeData->timeouts->add(timeout, ZEROCOPY_REAP_MS);
+                    return;
+                }
+                // the kernel may still read them, leaked rather than reused
+                for (ZeroCopy::Send &send : zeroCopy->sends) {
+                    nodeData->zeroCopyStats->abandonedBytes += send.bytes;
+                }
+            }
+            nodeData->netContext->closeSocket(zeroCopy->fd);
+            delete zeroCopy;
+        };
+        zeroCopy->reap.cb(&zeroCopy->reap);
+    }
+#endif
+
     template <class STATE>
     static void ioHandler(Poll *p, int status, int events) {
         Socket *socket = (Socket *) p;
@@ -220,44 +551,32 @@ protected:
         Context *netContext = nodeData->netContext;
 
         if (status < 0) {
-            STATE::onEnd((Socket *) p);
-            return;
+#ifdef UWS_ZEROCOPY
+            if (!socket->zeroCopy || !socket->reapZeroCopy())
+#endif
+            {
+                STATE::onEnd((Socket *) p);
+                return;
+            }
         }
 
         if (events & UV_WRITABLE) {
-            if (!socket->messageQueue.empty() && (events & UV_WRITABLE)) {
-                socket->cork(true);
-                while (true) {
-                    Queue::Message *messagePtr = socket->messageQueue.front();
-                    ssize_t sent = ::send(socket->getFd(), messagePtr->data, messagePtr->length, MSG_NOSIGNAL);
-                    if (sent == (ssize_t) messagePtr->length) {
-                        if (messagePtr->callback) {
-                            messagePtr->callback(p, messagePtr->callbackData, false, messagePtr->reserved);
-                        }
-                        socket->messageQueue.pop();
-                        if (socket->messageQueue.empty()) {
-                            // todo, remove bit, don't set directly
-                            socket->change(socket->nodeData->loop, socket, socket->setPoll(UV_READABLE));
-                            break;
-                        }
-                    } else if (sent == SOCKET_ERROR) {
-                        if (!netContext->wouldBlock()) {
-                            STATE::onEnd((Socket *) p);
-                            return;
-                        }
-                        break;
-                    } else {
-                        messagePtr->length -= sent;
-                        messagePtr->data += sent;
-                        break;
-                    }
+            if (!socket->messageQueue.empty()) {
+                if (!socket->drainQueue()) {
+                    STATE::onEnd((Socket *) p);
+                    return;
+                }
+                if (socket->messageQueue.empty()) {
+                    // todo, remove bit, don't set directly
+                    socket->change(socket->nodeData->loop, socket, socket->setPoll(UV_READABLE));
                 }
-                socket->cork(false);
             }
         }
 
         if (events & UV_READABLE) {
+            uint64_t readStart = socket->readStarted();
             int length = (int) recv(socket->getFd(), nodeData->recvBuffer, nodeData->recvLength, 0);
+            socket->readEnded(readStart);
             if (length > 0) {
                 STATE::onData((Socket *) p, nodeData->recvBuffer, length);
             } else if (length <= 0 || (length == SOCKET_ERROR && !netContext->wouldBlock())) {
@@ -269,7 +588,7 @@ protected:
 
     template<class STATE>
     void setState() {
-        if (ssl) {
+        if (ssl && !kernelTls()) {
             setCb(sslIoHandler<STATE>);
         } else {
             setCb(ioHandler<STATE>);
@@ -280,15 +599,152 @@ protected:
         return messageQueue.empty();
     }
 
+    static const int DRAIN_BATCH = 64; // messages gathered per send
+
+#ifndef _WIN32
+    // the unsent segments of message as iovecs, returns how many
+    static int gather(Queue::Message *message, iovec *buffers) {
+        buffers[0].iov_base = (void *) message->data;
+        buffers[0].iov_len = message->length;
+        if (!message->payload) {
+            return 1;
+        }
+        buffers[1].iov_base = message->payload->buffer + message->payloadSent;
+        buffers[1].iov_len = message->payload->length - message->payloadSent;
+        return 2;
+    }
+#endif
+
+    // Sends queued messages until the queue is empty or the socket would block, gathering
+    // up to DRAIN_BATCH of them per syscall. Returns false on socket error
+    bool drainQueue() {
+        while (!messageQueue.empty()) {
+            ssize_t sent;
+#ifdef _WIN32
+            int count = 1;
+            const char *segment;
+            size_t segmentLength = messageQueue.front()->segment(segment);
+            sent = ::send(getFd(), segment, (int) segmentLength, 0);
+#else
+            iovec buffers[2 * DRAIN_BATCH];
+            int count = 0, segments = 0, flags = MSG_NOSIGNAL;
+            for (Queue::Message *messagePtr = messageQueue.front(); messagePtr && count < DRAIN_BATCH; messagePtr = messagePtr->nextMessage) {
+#ifdef UWS_ZEROCOPY
+                // zero-copy messages go alone, so that each send pins the pages of one message
+                if (zeroCopies(messagePtr)) {
+                    if (!count) {
+                        segments = gather(messagePtr, buffers);
+                        count = 1;
+                        flags |= MSG_ZEROCOPY;
+                    }
+                    break;
+                }
+#endif
+                segments += gather(messagePtr, buffers + segments);
+                count++;
+            }
+            msghdr header = {};
+            header.msg_iov = buffers;
+            header.msg_iovlen = segments;
+            sent = ::sendmsg(getFd(), &header, flags);
+#endif
+#ifdef UWS_ZEROCOPY
+            if (flags & MSG_ZEROCOPY) {
+                if (sent == SOCKET_ERROR && errno == ENOBUFS) {
+                    // out of option memory to track pinned pages, copy this one
+                    sent = ::sendmsg(getFd(), &header, MSG_NOSIGNAL);
+                    if (sent != SOCKET_ERROR) {
+                        nodeData->zeroCopyStats->copiedBytes += sent;
+                    }
+                } else if (sent != SOCKET_ERROR) {
+                    zeroCopy->sends.push_back({(size_t) sent, nullptr, ZeroCopy::PENDING});
+                }
+            }
+#endif
+            if (sent == SOCKET_ERROR) {
+                return nodeData->netContext->wouldBlock();
+            }
+
+            // callbacks may append to the queue, but only behind the sent batch
+            size_t remaining = (size_t) sent;
+            uint64_t sentAt = 0;
+            for (int i = 0; i < count; i++) {
+                Queue::Message *messagePtr = messageQueue.front();
+                size_t size = messagePtr->size();
+                if (size > remaining) {
+                    // socket buffer is full
+                    messagePtr->consume(remaining);
+                    messageQueue.bytes -= remaining;
+                    updateBackpressure();
+                    return true;
+                }
+                remaining -= size;
+                recordQueued(messagePtr, sentAt);
+                if (messagePtr->callback) {
+                    messagePtr->callback(this, messagePtr->callbackData, false, messagePtr->reserved);
+                }
+#ifdef UWS_ZEROCOPY
+                // the kernel may still read the payload, its last send frees it
+                if ((flags & MSG_ZEROCOPY) && !zeroCopy->sends.empty() && !zeroCopy->sends.back().message) {
+                    zeroCopy->sends.back().message = messageQueue.pop();
+                    continue;
+                }
+#endif
+                freeMessage(messageQueue.pop());
+            }
+        }
+        updateBackpressure();
+        return true;
+    }
+
+#ifdef USE_EPOLL
+    // Loop::flushing callback, sends what was deferred this iteration unless the socket
+    // already waits for writability (then its io handler drains it)
+    static void flushDeferred(Poll *p) {
+        Socket *socket = (Socket *) p;
+        socket->state.flushQueued = false;
+        if (socket->isClosed() || socket->messageQueue.empty() || (socket->getPoll() & UV_WRITABLE)) {
+            return;
+        }
+
+        // on error the queue stays, the io handler then sees the error and ends the socket
+        if (socket->ssl && !socket->state.kernelTls) {
+            // SSL asks for writability itself, unless it waits to read
+            if (!socket->sslDrainQueue()) {
+                socket->change(socket->nodeData->loop, socket, socket->setPoll(socket->getPoll() | UV_WRITABLE));
+            }
+            return;
+        }
+        socket->drainQueue();
+        if (!socket->messageQueue.empty()) {
+            socket->change(socket->nodeData->loop, socket, socket->setPoll(socket->getPoll() | UV_WRITABLE));
+        }
+    }
+#endif
+
+    bool defersWrites() {
+#ifdef USE_EPOLL
+        return state.deferWrites;
+#else
+        return false;
+#endif
+    }
+
     void enqueue(Queue::Message *message) {
+        message->queuedAt = getLatency() ? Latency::now() : 0;
         messageQueue.push(message);
+        updateBackpressure();
     }
 
     Queue::Message *allocMessage(size_t length, const char *data = 0) {
-        Queue::Message *messagePtr = (Queue::Message *) new char[sizeof(Queue::Message) + length];
+        int sizeClass;
+        Queue::Message *messagePtr = (Queue::Message *) nodeData->memoryPool->allocate(sizeof(Queue::Message) + length, sizeClass);
+        messagePtr->sizeClass = sizeClass;
         messagePtr->length = length;
         messagePtr->data = ((char *) messagePtr) + sizeof(Queue::Message);
         messagePtr->nextMessage = nullptr;
+        messagePtr->payload = nullptr;
+        messagePtr->payloadSent = 0;
 
         if (data) {
             memcpy((char *) messagePtr->data, data, messagePtr->length);
@@ -297,21 +753,41 @@ protected:
         return messagePtr;
     }
 
+    static void freeMessage(NodeData *nodeData, Queue::Message *message) {
+        if (message->payload) {
+            message->payload->release();
+        }
+        nodeData->memoryPool->free((char *) message, message->sizeClass);
+    }
+
     void freeMessage(Queue::Message *message) {
-        delete [] (char *) message;
+        freeMessage(nodeData, message);
     }
 
     bool write(Queue::Message *message, bool &wasTransferred) {
         ssize_t sent = 0;
         if (messageQueue.empty()) {
 
-            if (ssl) {
-                sent = SSL_write(ssl, message->data, (int) message->length);
-                if (sent == (ssize_t) message->length) {
+#ifdef USE_EPOLL
+            // userspace corking: queue now, one gathered send (TLS: a record per TLS_RECORD_SIZE) per socket when the iteration ends
+            if (defersWrites() && nodeData->loop->iterating && nodeData->tid == pthread_self()) {
+                enqueue(message);
+                if (!state.flushQueued) {
+                    state.flushQueued = true;
+                    nodeData->loop->flushing.push_back({this, flushDeferred});
+                }
+                wasTransferred = true;
+                return true;
+            }
+#endif
+
+            if (ssl && !state.kernelTls) {
+                int written;
+                if (sslWrite(message, written)) {
                     wasTransferred = false;
                     return true;
-                } else if (sent < 0) {
-                    switch (SSL_get_error(ssl, (int) sent)) {
+                } else if (written < 0) {
+                    switch (SSL_get_error(ssl, written)) {
                     case SSL_ERROR_WANT_READ:
                         break;
                     case SSL_ERROR_WANT_WRITE:
@@ -325,8 +801,28 @@ protected:
                     }
                 }
             } else {
-                sent = ::send(getFd(), message->data, message->length, MSG_NOSIGNAL);
-                if (sent == (ssize_t) message->length) {
+#ifdef UWS_ZEROCOPY
+                if (zeroCopies(message)) {
+                    // left to drainQueue, which keeps the message until it completes
+                    sent = 0;
+                } else
+#endif
+#ifndef _WIN32
+                if (message->payload) {
+                    iovec buffers[2];
+                    msghdr header = {};
+                    header.msg_iov = buffers;
+                    header.msg_iovlen = gather(message, buffers);
+                    sent = ::sendmsg(getFd(), &header, MSG_NOSIGNAL);
+                } else
+#endif
+                {
+                    const char *segment;
+                    size_t segmentLength = message->segment(segment);
+                    sent = ::send(getFd(), segment, segmentLength, MSG_NOSIGNAL);
+                }
+
+                if (sent == (ssize_t) message->size()) {
                     wasTransferred = false;
                     return true;
                 } else if (sent == SOCKET_ERROR) {
@@ -334,8 +830,7 @@ protected:
                         return false;
                     }
                 } else {
-                    message->length -= sent;
-                    message->data += sent;
+                    message->consume(sent);
                 }
 
                 if ((getPoll() & UV_WRITABLE) == 0) {
@@ -344,66 +839,46 @@ protected:
                 }
             }
         }
-        messageQueue.push(message);
+        enqueue(message);
         wasTransferred = true;
         return true;
     }
 
     template <class T, class D>
     void sendTransformed(const char *message, size_t length, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData, D transformData) {
-        size_t estimatedLength = T::estimate(message, length) + sizeof(Queue::Message);
+        Queue::Message *messagePtr = allocMessage(T::estimate(message, length));
+        messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
+        sendMessage(messagePtr, callback, callbackData);
+    }
+
+    // sends header (copied) followed by payload (referenced, not copied) as one message
+    void sendShared(const char *header, size_t headerLength, SharedPayload *payload, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData) {
+        payload->references++;
+        Queue::Message *messagePtr = allocMessage(headerLength, header);
+        messagePtr->payload = payload;
+        sendMessage(messagePtr, callback, callbackData);
+    }
 
+    void sendMessage(Queue::Message *messagePtr, void(*callback)(void *socket, void *data, bool cancelled, void *reserved), void *callbackData) {
         if (hasEmptyQueue()) {
-            if (estimatedLength <= uS::NodeData::preAllocMaxSize) {
-                int memoryLength = (int) estimatedLength;
-                int memoryIndex = nodeData->getMemoryBlockIndex(memoryLength);
-
-                Queue::Message *messagePtr = (Queue::Message *) nodeData->getSmallMemoryBlock(memoryIndex);
-                messagePtr->data = ((char *) messagePtr) + sizeof(Queue::Message);
-                messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
-
-                bool wasTransferred;
-                if (write(messagePtr, wasTransferred)) {
-                    if (!wasTransferred) {
-                        nodeData->freeSmallMemoryBlock((char *) messagePtr, memoryIndex);
-                        if (callback) {
-                            callback(this, callbackData, false, nullptr);
-                        }
-                    } else {
-                        messagePtr->callback = callback;
-                        messagePtr->callbackData = callbackData;
-                    }
-                } else {
-                    nodeData->freeSmallMemoryBlock((char *) messagePtr, memoryIndex);
+            bool wasTransferred;
+            if (write(messagePtr, wasTransferred)) {
+                if (!wasTransferred) {
+                    freeMessage(messagePtr);
                     if (callback) {
-                        callback(this, callbackData, true, nullptr);
+                        callback(this, callbackData, false, nullptr);
                     }
+                } else {
+                    messagePtr->callback = callback;
+                    messagePtr->callbackData = callbackData;
                 }
             } else {
-                Queue::Message *messagePtr = allocMessage(estimatedLength - sizeof(Queue::Message));
-                messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
-
-                bool wasTransferred;
-                if (write(messagePtr, wasTransferred)) {
-                    if (!wasTransferred) {
-                        freeMessage(messagePtr);
-                        if (callback) {
-                            callback(this, callbackData, false, nullptr);
-                        }
-                    } else {
-                        messagePtr->callback = callback;
-                        messagePtr->callbackData = callbackData;
-                    }
-                } else {
-                    freeMessage(messagePtr);
-                    if (callback) {
-                        callback(this, callbackData, true, nullptr);
-                    }
+                freeMessage(messagePtr);
+                if (callback) {
+                    callback(this, callbackData, true, nullptr);
                 }
             }
         } else {
-            Queue::Message *messagePtr = allocMessage(estimatedLength - sizeof(Queue::Message));
-            messagePtr->length = T::transform(message, (char *) messagePtr->data, length, transformData);
             messagePtr->callback = callback;
             messagePtr->callbackData = callbackData;
             enqueue(messagePtr);
@@ -441,6 +916,37 @@ public:
 
     Address getAddress();
 
+    // Not thread safe
+    size_t getBufferedAmount() {
+        return messageQueue.bytes;
+    }
+
+    bool isBackpressured() {
+        return state.backpressured;
+    }
+
+    // Drops queued messages oldest first, until no more than bufferedAmount bytes are left.
+    // The head may be partly written and is kept. Returns the number of messages dropped
+    size_t dropBuffered(size_t bufferedAmount) {
+        size_t dropped = 0;
+        Queue::Message *previous = messageQueue.front();
+        while (previous && previous->nextMessage && messageQueue.bytes > bufferedAmount) {
+            Queue::Message *messagePtr = previous->nextMessage;
+            previous->nextMessage = messagePtr->nextMessage;
+            if (messageQueue.tail == messagePtr) {
+                messageQueue.tail = previous;
+            }
+            messageQueue.bytes -= messagePtr->size();
+            if (messagePtr->callback) {
+                messagePtr->callback(this, messagePtr->callbackData, true, messagePtr->reserved);
+            }
+            freeMessage(messagePtr);
+            dropped++;
+        }
+        updateBackpressure();
+        return dropped;
+    }
+
     void setNoDelay(int enable) {
         setsockopt(getFd(), IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
     }
@@ -470,10 +976,36 @@ public:
 
     template <class T>
     void closeSocket() {
+        cancelTimeout();
         uv_os_sock_t fd = getFd();
         Context *netContext = nodeData->netContext;
         stop(nodeData->loop);
-        netContext->closeSocket(fd);
+
+#ifdef UWS_ZEROCOPY
+        if (zeroCopy) {
+            reapZeroCopy();
+            if (!zeroCopy->sends.empty()) {
+                // the head partly sent with MSG_ZEROCOPY is kept by its last send, cancelled like the rest of the queue
+                if (!zeroCopy->sends.back().message) {
+                    Queue::Message *message = messageQueue.pop();
+                    if (message->callback) {
+                        message->callback(nullptr, message->callbackData, true, nullptr);
+                        message->callback = nullptr;
+                    }
+                    zeroCopy->sends.back().message = message;
+                }
+                orphanZeroCopy(nodeData, zeroCopy, fd);
+                fd = INVALID_SOCKET;
+            } else {
+                delete zeroCopy;
+            }
+            zeroCopy = nullptr;
+        }
+#endif
+
+        if (fd != INVALID_SOCKET) {
+            netContext->closeSocket(fd);
+        }
 
         if (ssl) {
             SSL_free(ssl);
@@ -492,6 +1024,10 @@ public:
     friend struct NodeData;
 };
 
+#ifdef USE_EPOLL
+static_assert(sizeof(void *) != 8 || sizeof(Socket) <= 128, "Socket should fit in two cache lines");
+#endif
+
 struct ListenSocket : Socket {
 
     ListenSocket(NodeData *nodeData, Loop *loop, uv_os_sock_t fd, SSL *ssl) : Socket(nodeData, loop, fd, ssl) {
@@ -0,0 +1,206 @@
+#ifndef TIMERWHEEL_UWS_H
+#define TIMERWHEEL_UWS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace uS {
+
+struct TimeoutLink {
+    TimeoutLink *next = nullptr, *prev = nullptr;
+};
+
+// intrusive entry of a TimerWheel, embedded in whatever it times out
+struct Timeout : TimeoutLink {
+    uint64_t expiry = 0;
+    void (*cb)(Timeout *) = nullptr;
+    void *data = nullptr;
+
+    Timeout() = default;
+
+    // a linked entry belongs to its wheel, copies (as made when sockets change type) start unlinked
+    Timeout(const Timeout &) {}
+    Timeout &operator=(const Timeout &) {
+        return *this;
+    }
+
+    bool isActive() {
+        return next;
+    }
+
+    void cancel() {
+        if (next) {
+            next->prev = prev;
+            prev->next = next;
+            next = prev = nullptr;
+        }
+    }
+};
+
+// hierarchical timing wheel in millisecond ticks: LEVELS levels of SLOTS slots, each slot spanning
+// one turn of the level below. adding and cancelling are O(1), a timeout moves down a level at
+// most LEVELS - 1 times before it fires. timeouts further out than RANGE are parked in the top
+// level and placed again when their slot comes up
+struct TimerWheel {
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    static const int LEVELS = 4;
+    static const uint64_t MASK = SLOTS - 1;
+    static const uint64_t RANGE = 1ull << (BITS * LEVELS); // 16.7 million ms, 4.6 hours
+
+    uint64_t now;       // set by whoever drives the wheel, once per loop iteration
+    uint64_t current;   // every timeout before this has fired
+    TimeoutLink slots[LEVELS][SLOTS];
+    uint64_t occupied[LEVELS] = {}; // slots that may hold timeouts, cleared lazily
+
+    // the coarse clock of the wheel, read once per loop iteration rather than per timeout
+    static uint64_t clock() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static int lowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return (int) index;
+#else
+        return __builtin_ctzll(bits);
+#endif
+    }
+
+    TimerWheel(uint64_t now) : now(now), current(now) {
+        for (int level = 0; level < LEVELS; level++) {
+            for (TimeoutLink &slot : slots[level]) {
+                slot.next = slot.prev = &slot;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    // (re)starts timeout to fire ms from now
+    void add(Timeout *timeout, uint64_t ms) {
+        timeout->cancel();
+        timeout->expiry = now + ms;
+        insert(timeout);
+    }
+
+    // fires everything due by now, callbacks may add and cancel freely
+    void expire() {
+        while (current <= now) {
+            uint64_t index = current & MASK;
+            if (!index) {
+                // entering a new turn: move the slots that start now down, the highest level first
+                int level = 1;
+                while (level < LEVELS - 1 && !((current >> (BITS * level)) & MASK)) {
+                    level++;
+                }
+                for (; level > 0; level--) {
+                    cascade(level, (current >> (BITS * level)) & MASK);
+                }
+            }
+
+            // skip to the next slot that may hold something, or the next turn
+            uint64_t ahead = occupied[0] >> index;
+            if (!ahead) {
+                current = std::min<uint64_t>((current | MASK) + 1, now + 1);
+                continue;
+            }
+            uint64_t skip = (uint64_t) lowestBit(ahead);
+            if (skip) {
+                current = std::min<uint64_t>(current + skip, now + 1);
+                continue;
+            }
+
+            // timeouts added by the callbacks land in later slots, cancelling unlinks from pending
+            TimeoutLink pending;
+            detach(slots[0][index], pending);
+            occupied[0] &= ~(1ull << index);
+            current++;
+            while (pending.next != &pending) {
+                Timeout *timeout = (Timeout *) pending.next;
+                timeout->cancel();
+                timeout->cb(timeout);
+            }
+        }
+    }
+
+    // ms until the wheel next has work, a timeout to fire or a slot to move down, -1 if empty
+    int timeUntilNext() {
+        uint64_t next = UINT64_MAX;
+
+        if (occupied[0]) {
+            int index = (int) (current & MASK);
+            uint64_t rotated = (occupied[0] >> index) | (index ? occupied[0] << (SLOTS - index) : 0);
+            next = current + lowestBit(rotated);
+        }
+        for (int level = 1; level < LEVELS; level++) {
+            if (occupied[level]) {
+                // slots move down as their turn starts, the first start not yet handled is at or after current
+                uint64_t turn = (current + (1ull << (BITS * level)) - 1) >> (BITS * level);
+                int index = (int) (turn & MASK);
+                uint64_t rotated = (occupied[level] >> index) | (index ? occupied[level] << (SLOTS - index) : 0);
+                next = std::min<uint64_t>(next, (turn + lowestBit(rotated)) << (BITS * level));
+            }
+        }
+
+        if (next == UINT64_MAX) {
+            return -1;
+        }
+        return next <= now ? 0 : (int) std::min<uint64_t>(next - now, INT32_MAX);
+    }
+
+private:
+    void insert(Timeout *timeout) {
+        uint64_t expiry = timeout->expiry < current ? current : timeout->expiry;
+        if (expiry - current >= RANGE) {
+            expiry = current + RANGE - 1;
+        }
+
+        int level = 0;
+        while ((expiry - current) >> (BITS * (level + 1))) {
+            level++;
+        }
+        uint64_t index = (expiry >> (BITS * level)) & MASK;
+
+        TimeoutLink &slot = slots[level][index];
+        timeout->prev = slot.prev;
+        timeout->next = &slot;
+        slot.prev->next = timeout;
+        slot.prev = timeout;
+        occupied[level] |= 1ull << index;
+    }
+
+    // moves the list of slot to the empty list
+    static void detach(TimeoutLink &slot, TimeoutLink &list) {
+        if (slot.next == &slot) {
+            list.next = list.prev = &list;
+        } else {
+            list.next = slot.next;
+            list.prev = slot.prev;
+            list.next->prev = list.prev->next = &list;
+            slot.next = slot.prev = &slot;
+        }
+    }
+
+    void cascade(int level, uint64_t index) {
+        TimeoutLink moving;
+        detach(slots[level][index], moving);
+        occupied[level] &= ~(1ull << index);
+        while (moving.next != &moving) {
+            Timeout *timeout = (Timeout *) moving.next;
+            timeout->cancel();
+            insert(timeout);
+        }
+    }
+};
+
+}
+
+#endif // TIMERWHEEL_UWS_H
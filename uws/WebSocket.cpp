@@ -7,6 +7,7 @@ namespace uWS {
 template <bool isServer>
 WebSocket<isServer>::WebSocket(bool perMessageDeflate, uS::Socket *socket) : uS::Socket(std::move(*socket)) {
     compressionStatus = perMessageDeflate ? CompressionStatus::ENABLED : CompressionStatus::DISABLED;
+    state.deferWrites = true;
 
     // if we are created in a group with sliding deflate window allocate it here
     if (Group<isServer>::from(this)->extensionOptions & SLIDING_DEFLATE_WINDOW) {
@@ -62,6 +63,12 @@ void WebSocket<isServer>::send(const char *message, size_t length, OpCode opCode
     sendTransformed<WebSocketTransformer>((char *) message, length, (void(*)(void *, void *, bool, void *)) callback, callbackData, transformData);
 }
 
+template <bool isServer>
+static void destroyPreparedMessage(uS::SharedPayload *payload) {
+    delete [] payload->buffer;
+    delete (typename WebSocket<isServer>::PreparedMessage *) payload;
+}
+
 /*
  * Prepares a single message for use with sendPrepared.
  *
@@ -77,6 +84,7 @@ typename WebSocket<isServer>::PreparedMessage *WebSocket<isServer>::prepareMessa
     preparedMessage->buffer = new char[length + 10];
     preparedMessage->length = WebSocketProtocol<isServer, WebSocket<isServer>>::formatMessage(preparedMessage->buffer, data, length, opCode, length, compressed);
     preparedMessage->references = 1;
+    preparedMessage->destroy = destroyPreparedMessage<isServer>;
     preparedMessage->callback = (void(*)(void *, void *, bool, void *)) callback;
     return preparedMessage;
 }
@@ -108,6 +116,7 @@ typename WebSocket<isServer>::PreparedMessage *WebSocket<isServer>::prepareMessa
     }
     preparedMessage->length = offset;
     preparedMessage->references = 1;
+    preparedMessage->destroy = destroyPreparedMessage<isServer>;
     preparedMessage->callback = (void(*)(void *, void *, bool, void *)) callback;
     return preparedMessage;
 }
@@ -119,41 +128,41 @@ typename WebSocket<isServer>::PreparedMessage *WebSocket<isServer>::prepareMessa
  * message is sent to multiple recipients. Do not used if only sending one message
  * in total.
  *
- * Warning: Modifies passed PreparedMessage and is thus not thread safe. Other
- * data is also modified and it makes sense to not make this function thread-safe
- * since it is a central part in broadcasting and other high-perf code paths.
+ * Warning: Not thread safe with respect to this socket. The reference count of
+ * passed PreparedMessage is atomic, so sockets of different loops may send the
+ * same PreparedMessage concurrently.
  *
  */
 template <bool isServer>
 void WebSocket<isServer>::sendPrepared(typename WebSocket<isServer>::PreparedMessage *preparedMessage, void *callbackData) {
-    // todo: see if this can be made a transformer instead
+    // the queued message holds a reference until it is freed, no callback needed
+    if (!preparedMessage->callback) {
+        sendShared(nullptr, 0, preparedMessage, nullptr, nullptr);
+        return;
+    }
+
+    // the callback tells whether it got the last reference, so it drops the reference itself
     preparedMessage->references++;
     void (*callback)(void *webSocket, void *userData, bool cancelled, void *reserved) = [](void *webSocket, void *userData, bool cancelled, void *reserved) {
         PreparedMessage *preparedMessage = (PreparedMessage *) userData;
         bool lastReference = !--preparedMessage->references;
 
-        if (preparedMessage->callback) {
-            preparedMessage->callback(webSocket, reserved, cancelled, (void *) lastReference);
-        }
+        preparedMessage->callback(webSocket, reserved, cancelled, (void *) lastReference);
 
         if (lastReference) {
-            delete [] preparedMessage->buffer;
-            delete preparedMessage;
+            preparedMessage->destroy(preparedMessage);
         }
     };
 
-    // candidate for fixed size pool allocator
-    int memoryLength = sizeof(Queue::Message);
-    int memoryIndex = nodeData->getMemoryBlockIndex(memoryLength);
-
-    Queue::Message *messagePtr = (Queue::Message *) nodeData->getSmallMemoryBlock(memoryIndex);
+    // only the header, the frame stays in the prepared message
+    Queue::Message *messagePtr = allocMessage(0);
     messagePtr->data = preparedMessage->buffer;
     messagePtr->length = preparedMessage->length;
 
     bool wasTransferred;
     if (write(messagePtr, wasTransferred)) {
         if (!wasTransferred) {
-            nodeData->freeSmallMemoryBlock((char *) messagePtr, memoryIndex);
+            freeMessage(messagePtr);
             if (callback) {
                 callback(this, preparedMessage, false, callbackData);
             }
@@ -163,7 +172,7 @@ void WebSocket<isServer>::sendPrepared(typename WebSocket<isServer>::PreparedMes
             messagePtr->reserved = callbackData;
         }
     } else {
-        nodeData->freeSmallMemoryBlock((char *) messagePtr, memoryIndex);
+        freeMessage(messagePtr);
         if (callback) {
             callback(this, preparedMessage, true, callbackData);
         }
@@ -175,16 +184,12 @@ void WebSocket<isServer>::sendPrepared(typename WebSocket<isServer>::PreparedMes
  * the memory will be deleted.
  *
  * Hints: Used together with prepareMessage, prepareMessageBatch and similar calls.
- *
- * Warning: Will modify passed PrepareMessage and is thus not thread safe by itself.
+ * The reference count is atomic, so the last reference may be dropped from any thread.
  *
  */
 template <bool isServer>
 void WebSocket<isServer>::finalizeMessage(typename WebSocket<isServer>::PreparedMessage *preparedMessage) {
-    if (!--preparedMessage->references) {
-        delete [] preparedMessage->buffer;
-        delete preparedMessage;
-    }
+    preparedMessage->release();
 }
 
 template <bool isServer>
@@ -193,9 +198,13 @@ uS::Socket *WebSocket<isServer>::onData(uS::Socket *s, char *data, size_t length
 
     webSocket->hasOutstandingPong = false;
     if (!webSocket->isShuttingDown()) {
-        webSocket->cork(true);
+        // deferred writes already leave as one send per loop iteration, corking would only cost two syscalls
+        bool cork = !webSocket->defersWrites();
+        if (cork) {
+            webSocket->cork(true);
+        }
         WebSocketProtocol<isServer, WebSocket<isServer>>::consume(data, (unsigned int) length, webSocket);
-        if (!webSocket->isClosed()) {
+        if (cork && !webSocket->isClosed()) {
             webSocket->cork(false);
         }
     }
@@ -272,8 +281,7 @@ void WebSocket<isServer>::close(int code, const char *message, size_t length) {
     Group<isServer>::from(this)->disconnectionHandler(this, code, (char *) message, length);
     setShuttingDown(true);
 
-    // todo: using the shared timer in the group, we can skip creating a new timer per socket
-    // only this line and the one in Hub::connect uses the timeout feature
+    // replaces the auto-ping timeout, removeWebSocket cancelled it
     startTimeout<WebSocket<isServer>::onEnd>();
 
     char closePayload[MAX_CLOSE_PAYLOAD + 2];
@@ -303,7 +311,7 @@ void WebSocket<isServer>::onEnd(uS::Socket *s) {
         if (message->callback) {
             message->callback(nullptr, message->callbackData, true, nullptr);
         }
-        webSocket->messageQueue.pop();
+        webSocket->freeMessage(webSocket->messageQueue.pop());
     }
 
     webSocket->nodeData->clearPendingPollChanges(webSocket);
@@ -317,6 +325,29 @@ void WebSocket<isServer>::onEnd(uS::Socket *s) {
     }
 }
 
+// calls onMessage, timing it and the parsing since the last read or handler when latency is enabled
+template <bool isServer>
+void WebSocket<isServer>::handleMessage(char *data, size_t length, OpCode opCode) {
+    uS::Latency *latency = getLatency();
+    if (!latency) {
+        Group<isServer>::from(this)->messageHandler(this, data, length, opCode);
+        return;
+    }
+
+    uint64_t handlerStart = uS::Latency::now();
+    if (latency->readTime) {
+        latency->record(uS::LATENCY_PARSE, handlerStart - latency->readTime);
+    }
+    Group<isServer>::from(this)->messageHandler(this, data, length, opCode);
+    uint64_t handlerEnd = uS::Latency::now();
+    latency->record(uS::LATENCY_HANDLER, handlerEnd - handlerStart);
+
+    // the next message of the same read is parsed from here on
+    if (latency->readTime) {
+        latency->readTime = handlerEnd;
+    }
+}
+
 template <bool isServer>
 bool WebSocket<isServer>::handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, WebSocketState<isServer> *webSocketState) {
     WebSocket<isServer> *webSocket = static_cast<WebSocket<isServer> *>(webSocketState);
@@ -338,7 +369,7 @@ bool WebSocket<isServer>::handleFragment(char *data, size_t length, unsigned int
                 return true;
             }
 
-            group->messageHandler(webSocket, data, length, (OpCode) opCode);
+            webSocket->handleMessage(data, length, (OpCode) opCode);
             if (webSocket->isClosed() || webSocket->isShuttingDown()) {
                 return true;
             }
@@ -363,7 +394,7 @@ bool WebSocket<isServer>::handleFragment(char *data, size_t length, unsigned int
                     return true;
                 }
 
-                group->messageHandler(webSocket, data, length, (OpCode) opCode);
+                webSocket->handleMessage(data, length, (OpCode) opCode);
                 if (webSocket->isClosed() || webSocket->isShuttingDown()) {
                     return true;
                 }
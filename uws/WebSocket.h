@@ -4,6 +4,8 @@
 #include "WebSocketProtocol.h"
 #include "Socket.h"
 
+#include <atomic>
+
 namespace uWS {
 
 template <bool isServer>
@@ -53,12 +55,11 @@ protected:
     }
 
     static bool handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, WebSocketState<isServer> *webSocketState);
+    void handleMessage(char *data, size_t length, OpCode opCode);
 
 public:
-    struct PreparedMessage {
-        char *buffer;
-        size_t length;
-        int references;
+    // a framed message, shared by sockets of any loop (the references are atomic)
+    struct PreparedMessage : uS::SharedPayload {
         void(*callback)(void *webSocket, void *data, bool cancelled, void *reserved);
     };
 
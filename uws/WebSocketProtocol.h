@@ -3,6 +3,7 @@
 
 // we do need to include this for htobe64, should be moved from networking!
 #include "Networking.h"
+#include "Simd.h"
 
 #include <cstring>
 #include <cstdlib>
@@ -69,7 +70,12 @@ protected:
     static inline bool rsv23(char *frame) {return *((unsigned char *) frame) & 48;}
     static inline bool rsv1(char *frame) {return *((unsigned char *) frame) & 64;}
 
+    // short frames stay inline, longer ones go to the vector kernel
     static inline void unmaskImprecise(char *dst, char *src, char *mask, unsigned int length) {
+        if (length >= 16) {
+            Simd::unmask(dst, src, mask, ((length >> 2) + 1) * 4);
+            return;
+        }
         for (unsigned int n = (length >> 2) + 1; n; n--) {
             *(dst++) = *(src++) ^ mask[0];
             *(dst++) = *(src++) ^ mask[1];
@@ -92,6 +98,10 @@ protected:
     }
 
     static inline void unmaskInplace(char *data, char *stop, char *mask) {
+        if (stop - data >= 16) {
+            Simd::unmask(data, data, mask, stop - data);
+            return;
+        }
         while (data < stop) {
             *(data++) ^= mask[0];
             *(data++) ^= mask[1];
@@ -206,45 +216,8 @@ public:
 
     }
 
-    // Based on utf8_check.c by Markus Kuhn, 2005
-    // https://www.cl.cam.ac.uk/~mgk25/ucs/utf8_check.c
-    // Optimized for predominantly 7-bit content by Alex Hultman, 2016
-    // Licensed as Zlib, like the rest of this project
-    static bool isValidUtf8(unsigned char *s, size_t length)
-    {
-        for (unsigned char *e = s + length; s != e; ) {
-            if (s + 4 <= e && ((*(uint32_t *) s) & 0x80808080) == 0) {
-                s += 4;
-            } else {
-                while (!(*s & 0x80)) {
-                    if (++s == e) {
-                        return true;
-                    }
-                }
-
-                if ((s[0] & 0x60) == 0x40) {
-                    if (s + 1 >= e || (s[1] & 0xc0) != 0x80 || (s[0] & 0xfe) == 0xc0) {
-                        return false;
-                    }
-                    s += 2;
-                } else if ((s[0] & 0xf0) == 0xe0) {
-                    if (s + 2 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 ||
-                            (s[0] == 0xe0 && (s[1] & 0xe0) == 0x80) || (s[0] == 0xed && (s[1] & 0xe0) == 0xa0)) {
-                        return false;
-                    }
-                    s += 3;
-                } else if ((s[0] & 0xf8) == 0xf0) {
-                    if (s + 3 >= e || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80 ||
-                            (s[0] == 0xf0 && (s[1] & 0xf0) == 0x80) || (s[0] == 0xf4 && s[1] > 0x8f) || s[0] > 0xf4) {
-                        return false;
-                    }
-                    s += 4;
-                } else {
-                    return false;
-                }
-            }
-        }
-        return true;
+    static bool isValidUtf8(unsigned char *s, size_t length) {
+        return Simd::isValidUtf8(s, length);
     }
 
     struct CloseFrame {